@@ -10,6 +10,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <ctype.h>
 #include <math.h>
 #include "type.h"
@@ -22,30 +23,91 @@ struct doc clipboard;
 
 pthread_t ctrl_thread;
 
+void usage (char *name)
+{
+	fprintf(stderr,
+	        "Usage: %s [-l eager|lazy|parallel] [-f fps] [-n] [-r bytes]\n"
+	        "          [-s socket] [-m shm-name]\n"
+	        "  -l  how glyphs are extracted from an uncached font\n"
+	        "  -f  cap on frames per second, 0 for none\n"
+	        "  -n  do not wait for vsync when presenting\n"
+	        "  -r  size of the control input ring\n"
+	        "  -s  path of the command socket, empty for none\n"
+	        "  -m  name of a shared memory command ring to create\n",
+	        name);
+}
+
 int init_all (int argc, char **args)
 {
+	int opt;
+
+	while ((opt = getopt(argc, args, "l:f:nr:s:m:")) != -1) {
+		switch (opt) {
+			case 'l':
+				font_mode &= ~FONT_LOAD_MASK;
+				if (!strcmp(optarg, "eager")) {
+					font_mode |= FONT_EAGER;
+				} else if (!strcmp(optarg, "lazy")) {
+					font_mode |= FONT_LAZY;
+				} else if (!strcmp(optarg, "parallel")) {
+					font_mode |= FONT_PARALLEL;
+				} else {
+					usage(args[0]);
+					return 0;
+				}
+				break;
+			case 'f':
+				frame_cap = atoi(optarg);
+				break;
+			case 'n':
+				vsync = 0;
+				break;
+			case 'r':
+				ring_size = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				sock_path = optarg;
+				break;
+			case 'm':
+				shm_name = optarg;
+				break;
+			default:
+				usage(args[0]);
+				return 0;
+		}
+	}
+
+	init_blit();
+	init_pool();
 	init_control();
 
 	allbuf = default_buffer();
+
+	return 1;
 }
 
 int cleanup_all ()
 {
 	cleanup_control();
 	cleanup_buffers();
+	cleanup_pool();
 }
 
 int main (int argc, char **args)
 {
-	init_all(argc, args);
+	if (!init_all(argc, args))
+		return 1;
 
 	if (pthread_create(&ctrl_thread, NULL, control_loop, NULL)) {
 		fprintf(stderr,
 		        "Error creating thread.\n"
 		        "Could not create control pipe.\n");
 		gui_loop();
-		pthread_cancel(ctrl_thread);
-	} else gui_loop();
+	} else {
+		gui_loop();
+		stop_control();
+		pthread_join(ctrl_thread, NULL);
+	}
 
 	cleanup_all();
 
@@ -3,6 +3,30 @@
 
 #define CLIP_ON 32
 
+#define CACHE_LINE 64
+
+#define BYTES_PER_PIXEL 4
+#define BITS_PER_PIXEL 32
+#define RMASK 0xff000000
+#define GMASK 0x00ff0000
+#define BMASK 0x0000ff00
+#define AMASK 0x000000ff
+#define RSHIFT 24
+#define GSHIFT 16
+#define BSHIFT 8
+#define TRANSPARENT_R 0xff
+#define TRANSPARENT_G 0xff
+#define TRANSPARENT_B 0xff
+#define TRANSPARENT_A 0x00
+#define TRANSPARENT_RGBA 0xffffff00
+#define TEXTURE_FORMAT SDL_PIXELFORMAT_RGBA8888
+
+#define FONT_EAGER 0
+#define FONT_LAZY 1
+#define FONT_PARALLEL 2
+#define FONT_LOAD_MASK 3
+#define FONT_NO_CACHE 4
+
 struct palette {
 	unsigned ref;
 	unsigned char num_colors;
@@ -13,17 +37,138 @@ struct palette {
 	} *cmy;
 };
 
+struct span {
+	Uint16 x;
+	Uint16 w;
+};
+
+struct glyph {
+	Uint32 size;
+	Uint16 x;
+	Uint16 y;
+	Uint16 w;
+	Uint16 h;
+	Uint16 pitch;
+	Uint16 num_spans;
+	Uint32 spans;
+	Uint32 bits;
+};
+
+#define glyph_rows(g) ((Uint16 *) ((Uint8 *) (g) + sizeof(struct glyph)))
+#define glyph_spans(g) ((struct span *) ((Uint8 *) (g) + (g)->spans))
+#define glyph_bits(g) ((Uint8 *) (g) + (g)->bits)
+
 struct font {
 	unsigned ref;
 	int w;
 	int h;
-	unsigned char *glyph[256];
+	struct glyph *glyph[256];
+	Uint64 hash;
+	void *map;
+	size_t map_len;
+	SDL_Surface *img;
+	pthread_mutex_t lock;
+	atomic_uchar loaded[256];
 };
 
+struct font_cache {
+	unsigned char magic[4];
+	Uint32 w;
+	Uint32 h;
+	Uint32 glyph[256];
+	Uint32 size;
+	Uint64 src_size;
+	Uint64 src_hash;
+};
+
+#define CELL_INLINE 4
+
 struct stroke {
 	unsigned char color;
 	unsigned char glyph;
-	struct stroke *next;
+};
+
+struct cell {
+	Uint32 len;
+	Uint32 spill;
+	struct stroke stroke[CELL_INLINE];
+};
+
+#define TILE_COLS 16
+#define TILE_ROWS 16
+#define TILE_BLOCKS (TILE_COLS * (TILE_ROWS / 2))
+
+// A square of cells and the pixel blocks that show them, each part
+// allocated the first time something is written to it. Tile rows line up
+// with block rows, so a tile holds TILE_ROWS / 2 rows of blocks. Blocks
+// with no ink point at the document's shared blank block. On screen a
+// tile is one texture, built when it comes into view.
+struct tile {
+	struct cell *cell;
+	Uint8 **block;
+	SDL_Texture *texture;
+};
+
+struct spill {
+	struct stroke *stroke;
+	Uint32 len;
+	Uint32 size;
+	Uint32 free[32];
+};
+
+// Blocks set aside for a later pass, as a bitmap for each tile that has
+// any. A hash from tile to entry finds them, so marking costs the same on
+// any size of sheet and a pass only visits what was marked.
+struct marked {
+	int x;
+	int y;
+	Uint64 bits[TILE_BLOCKS / 64];
+};
+
+struct marks {
+	int tiles_x;
+	int len;
+	int size;
+	struct marked *tile;
+	int last;
+	int num_slots;
+	int *slot;
+};
+
+struct resident {
+	int level;
+	int x;
+	int y;
+};
+
+struct upload {
+	int back;
+	struct marks *dirty[2];
+	int num_open;
+	SDL_Rect *open;
+	SDL_Rect *run;
+	int num_resident;
+	int size_resident;
+	struct resident *resident;
+};
+
+// A level of the pyramid shown when zoomed out, in block units. Level 0
+// is the document's own tiles; each block above is the box filtered 2x2
+// blocks below it, at the same size.
+struct lod {
+	int cols;
+	int rows;
+	int tiles_x;
+	int tiles_y;
+	struct tile ***tile;
+	struct marks *dirty;
+};
+
+// Blocks whose strokes changed inside begin_batch. The outermost
+// commit_batch redraws each of them once, one job per stale tile.
+struct batch {
+	int depth;
+	struct marks *stale;
 };
 
 struct doc {
@@ -31,13 +176,97 @@ struct doc {
 	struct palette *palette;
 	int cols;
 	int rows;
-	struct stroke **stroke;
-	SDL_Surface *surface;
-	int num_blocks;
-	Uint8 **pixels;
-	SDL_Texture *texture;
+	int tiles_x;
+	int tiles_y;
+	struct tile ***tile;
+	struct spill *spill;
+	int pitch;
+	size_t block_size;
+	Uint8 *blank;
 	int texture_w;
 	int texture_h;
+	struct upload *upload;
+	int num_lods;
+	struct lod *lod;
+	struct batch *batch;
+};
+
+// skip counts the bytes of an oversize frame still to be thrown away as
+// they arrive.
+struct chbuf {
+	size_t size;
+	size_t len;
+	size_t skip;
+	unsigned char *ch;
+};
+
+#define CMD_NONE 0
+#define CMD_TYPE 1
+#define CMD_NEWLINE 2
+#define CMD_MOVE 3
+#define CMD_QUIT 4
+#define CMD_QUERY 5
+#define CMD_TEST 6
+#define CMD_PLACE 7
+#define CMD_CLEAR 8
+
+// Stands in for an argument left out of a command, filled from the
+// cursor when the command runs.
+#define ARG_DEFAULT INT_MIN
+
+// One parsed control command. Bindings, pipes, sockets and shared memory
+// all turn their input into these once; run_command is the only executor.
+struct command {
+	Uint8 op;
+	Uint8 color;
+	Uint8 glyph;
+	int a;
+	int b;
+	int c;
+	int d;
+};
+
+struct cmdq {
+	size_t size;
+	size_t len;
+	struct command *cmd;
+};
+
+// Bounded single-producer, single-consumer byte ring. The indices only
+// grow; the size is a power of two. A full ring holds the producer in
+// ring_wait until the consumer frees space.
+struct ring {
+	size_t size;
+	unsigned char *ch;
+	_Alignas(CACHE_LINE) atomic_size_t head;
+	_Alignas(CACHE_LINE) atomic_size_t tail;
+	atomic_char waiting;
+	atomic_char closed;
+	pthread_mutex_t lock;
+	pthread_cond_t space;
+};
+
+#define CTRL_QUANTUM (1 << 14)
+#define MAX_CLIENTS 64
+#define CLIENT_FREE 0
+#define CLIENT_OPEN 1
+#define CLIENT_CLOSED 2
+
+// A socket connection. The server thread fills in and drains out; the
+// GUI thread parses in with the client's own cursor and buffer.
+struct client {
+	atomic_int state;
+	atomic_char throttled;
+	int fd;
+	struct ring *in;
+	struct ring *out;
+	struct chbuf *pending;
+	unsigned char *unsent;
+	size_t unsent_at;
+	size_t unsent_len;
+	struct buffer *buf;
+	int ptr_col;
+	int ptr_row;
 };
 
 struct select {
@@ -50,11 +279,18 @@ struct select {
 	struct select *next;
 };
 
+// Tab stops, as sorted columns or rows. Only set stops are stored.
+struct tabs {
+	int len;
+	int size;
+	int *at;
+};
+
 struct buffer {
 	struct doc doc;
 
-	int *h_tab;
-	int *v_tab;
+	struct tabs h_tab;
+	struct tabs v_tab;
 
 	int top_margin;
 	int bottom_margin;
@@ -84,7 +320,6 @@ extern unsigned mode;
 
 extern SDL_Window *window;
 extern SDL_Renderer *renderer;
-extern SDL_Texture *texture;
 
 extern SDL_Rect frame;
 extern SDL_Rect cursor;
@@ -94,33 +329,123 @@ extern struct buffer *allbuf;
 extern struct buffer *curbuf;
 extern struct doc clipboard;
 
+extern unsigned font_mode;
+extern char vsync;
+extern size_t ring_size;
+extern unsigned frame_cap;
+
 extern unsigned char *fifo_in;
 extern unsigned char *fifo_out;
+extern unsigned char *sock_path;
+extern unsigned char *shm_name;
+extern int stop_event;
+
+struct chbuf *new_chbuf ();
+int chbuf_reserve (struct chbuf *chbuf, size_t len);
+void destroy_chbuf (struct chbuf **chbuf_p);
+void chbuf_handle (struct buffer *buf, struct chbuf *chbuf);
+struct cmdq *new_cmdq ();
+int cmdq_push (struct cmdq *cmdq, struct command *cmd);
+int cmdq_append (struct cmdq *cmdq, unsigned char *str);
+void destroy_cmdq (struct cmdq **cmdq_p);
+size_t parse_commands (struct chbuf *chbuf, struct cmdq *cmdq);
+void run_command (struct buffer *buf, struct command *cmd);
+void run_cmdq (struct buffer *buf, struct cmdq *cmdq);
+struct ring *new_ring (size_t size);
+void destroy_ring (struct ring **ring_p);
+size_t ring_write (struct ring *ring, unsigned char *src, size_t len);
+size_t ring_read (struct ring *ring, unsigned char *dest, size_t len);
+int wait_fd (int fd, short events);
 
 void init_control ();
 void cleanup_control ();
 void handle_keypress (SDL_Keymod mod, long unsigned key);
-void control_handle (struct buffer *buf);
+int control_handle (struct buffer *buf);
+void control_reply (unsigned char *str, size_t len);
 void *control_loop (void *params);
+void stop_control ();
+
+void init_server ();
+void cleanup_server ();
+void *server_loop (void *params);
+int server_handle ();
+int server_reply (unsigned char *str, size_t len);
 
 void gui_loop();
+void gui_wake ();
+
+void init_pool ();
+void cleanup_pool ();
+void pool_run (int n, void (*fn) (void *arg, int i), void *arg);
+
+extern void (*blit_run) (Uint32 *dest, int n, Uint32 sub);
+void init_blit ();
+Uint32 cmy_to_sub (struct cmy cmy);
+void blit_run_scalar (Uint32 *dest, int n, Uint32 sub);
+void blit_run_sse2 (Uint32 *dest, int n, Uint32 sub);
+void blit_run_avx2 (Uint32 *dest, int n, Uint32 sub);
+void blit_glyph (Uint8 *pixels, int pitch, int h, struct glyph *glyph, Uint32 sub, int offset);
+extern void (*box_run) (Uint32 *dest, Uint32 *a, Uint32 *b, int n);
+void box_run_scalar (Uint32 *dest, Uint32 *a, Uint32 *b, int n);
+void box_run_sse2 (Uint32 *dest, Uint32 *a, Uint32 *b, int n);
+void box_run_avx2 (Uint32 *dest, Uint32 *a, Uint32 *b, int n);
+
+struct glyph *new_glyph (unsigned char *ink, int ink_pitch, SDL_Rect box, int num_spans);
+struct glyph *get_glyph (SDL_Surface *img, SDL_Rect block);
+struct font *load_font (unsigned char *path);
+struct glyph *font_glyph (struct font *font, unsigned char i);
+struct font *copy_font (struct font *font);
+void destroy_font (struct font **font_p);
 
 struct buffer *default_buffer ();
 void cleanup_buffers ();
 void zoom_to_fit (struct buffer *buf);
 void render_doc (struct doc *doc);
+struct marks *new_marks (int tiles_x);
+void destroy_marks (struct marks **marks_p);
+int mark_block (struct marks *marks, int col, int row);
+void sort_marks (struct marks *marks);
+void clear_marks (struct marks *marks);
+struct upload *new_upload (int cols, int rows);
+void destroy_upload (struct upload **upload_p);
+void upload_tile (struct doc *doc, int level, int x, int y, SDL_Rect blocks);
+void upload_rect (struct doc *doc, int level, SDL_Rect blocks);
+int new_lods (struct doc *doc);
+void destroy_lods (struct doc *doc);
+void destroy_tiles (struct doc doc, struct tile ***tile, int tiles_x, int tiles_y);
+struct tile *lod_tile (struct lod *lod, int x, int y, int make);
+Uint8 *lod_pixels (struct doc *doc, int level, int col, int row);
+void mark_lod (struct doc doc, int level, int col, int row);
+void flush_lods (struct doc *doc);
+struct batch *new_batch (int tiles_x);
+void destroy_batch (struct batch **batch_p);
+void begin_batch (struct doc doc);
+void commit_batch (struct doc doc);
+void flush_doc (struct doc *doc);
+void flush_uploads ();
+void show_doc (struct doc *doc, SDL_Rect *dest);
 void choose_buffer (struct buffer *buf);
+void draw_block (struct doc doc, int col, int row);
 void draw_doc (struct doc doc);
+void render_block (struct doc doc, int col, int row);
+struct cell *doc_cell (struct doc doc, int col, int row);
+struct cell *touch_cell (struct doc doc, int col, int row);
+Uint8 *block_pixels (struct doc doc, int col, int row);
+struct stroke *cell_strokes (struct doc doc, struct cell *cell);
 struct stroke *add_stroke (struct doc doc, int col, int row, unsigned char color, unsigned char glyph);
 struct stroke *del_stroke (struct doc doc, int col, int row);
+void clear_rect (struct doc doc, int col, int row, int cols, int rows);
 void update_cursor ();
 void update_selection (struct select *select);
 void update_margins ();
+int find_tab (struct tabs *tabs, int at);
+int set_tab (struct tabs *tabs, int at, int on);
 void update_frame ();
 void update_cursor_rgb ();
 void constrain_cursor (struct buffer *buf);
 int save_buffer (struct buffer *buf, FILE *f);
 struct buffer *load_buffer (FILE *f);
+struct buffer *load_file (unsigned char *path);
 void add_selection (struct buffer *buf, int start_col, int start_row, int end_col, int end_row);
 void copy_selection (struct buffer *buf);
 void paste_doc (struct doc dest, struct doc src, int at_col, int at_row);
@@ -129,6 +454,8 @@ void clear_selection (struct buffer *buf);
 void do_quit ();
 void do_absmove (struct buffer *buf, int col, int row);
 void do_type (struct buffer *buf, unsigned char glyph);
+void do_place (struct buffer *buf, int col, int row, unsigned char color, unsigned char glyph);
+void do_clear (struct buffer *buf, int col, int row, int cols, int rows);
 void do_test (struct buffer *buf, int a, int b, int c);
 
 #endif
@@ -0,0 +1,277 @@
+#include <SDL2/SDL_image.h>
+#include <SDL2/SDL.h>
+#include <X11/Xlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ctype.h>
+#include <math.h>
+#include "type.h"
+
+#define BENCH_W 90
+#define BENCH_H 142
+#define BENCH_GLYPHS 64
+#define BENCH_ROUNDS 200
+#define BENCH_BOX 4096
+
+typedef void (*run_fn) (Uint32 *dest, int n, Uint32 sub);
+typedef void (*box_fn) (Uint32 *dest, Uint32 *a, Uint32 *b, int n);
+
+// The per-pixel loop blit_cmy used before the span kernels.
+void blit_ref (SDL_Surface *dest, unsigned char *src, struct cmy cmy, int w, int h)
+{
+	Uint8 *p;
+	Uint8 r, g, b;
+
+	for (int y = 0; y < h; y++) {
+		p = dest->pixels + y * dest->pitch;
+		for (int x = 0; x < w; x++) {
+			if (*src) {
+				SDL_GetRGB(*((Uint32 *)p),
+				           dest->format,
+				           &r, &g, &b);
+				if (r > cmy.c) r -= cmy.c;
+				else           r  = 0;
+				if (g > cmy.m) g -= cmy.m;
+				else           g  = 0;
+				if (b > cmy.y) b -= cmy.y;
+				else           b  = 0;
+				*((Uint32 *) p) = SDL_MapRGBA(dest->format,
+				                              r, g, b, 0xff);
+			}
+			src++;
+			p += BYTES_PER_PIXEL;
+		}
+	}
+}
+
+void blit_fn (SDL_Surface *dest, struct glyph *glyph, struct cmy cmy, run_fn fn)
+{
+	blit_run = fn;
+	blit_glyph(dest->pixels, dest->pitch, dest->h, glyph, cmy_to_sub(cmy), 0);
+}
+
+double now ()
+{
+	return (double) SDL_GetPerformanceCounter() /
+	       (double) SDL_GetPerformanceFrequency();
+}
+
+double time_kernel (SDL_Surface *surface, unsigned char **mask, struct glyph **glyph,
+                    struct cmy *cmy, run_fn fn)
+{
+	double start = now();
+
+	for (int r = 0; r < BENCH_ROUNDS; r++) {
+		SDL_FillRect(surface, NULL, TRANSPARENT_RGBA);
+		for (int i = 0; i < BENCH_GLYPHS; i++) {
+			if (fn) {
+				blit_fn(surface, glyph[i], cmy[i], fn);
+			} else blit_ref(surface, mask[i], cmy[i], BENCH_W, BENCH_H);
+		}
+	}
+
+	return now() - start;
+}
+
+double time_box (Uint32 *dest, Uint32 *a, Uint32 *b, box_fn fn)
+{
+	double start = now();
+
+	for (int r = 0; r < BENCH_ROUNDS; r++)
+		fn(dest, a, b, BENCH_BOX);
+
+	return now() - start;
+}
+
+// Two random rows of 2 * BENCH_BOX pixels filtered down to one.
+void bench_box ()
+{
+	Uint32 *a = malloc(2 * BENCH_BOX * sizeof(Uint32));
+	Uint32 *b = malloc(2 * BENCH_BOX * sizeof(Uint32));
+	Uint32 *ref = malloc(BENCH_BOX * sizeof(Uint32));
+	Uint32 *out = malloc(BENCH_BOX * sizeof(Uint32));
+
+	struct {
+		const char *name;
+		box_fn fn;
+	} kernel[] = {
+		{"scalar", box_run_scalar},
+#if defined(__x86_64__) || defined(__i386__)
+		{"sse2", SDL_HasSSE2() ? box_run_sse2 : NULL},
+		{"avx2", SDL_HasAVX2() ? box_run_avx2 : NULL},
+#endif
+		{"dispatch", box_run},
+	};
+
+	if (!a || !b || !ref || !out)
+		goto done;
+
+	for (int i = 0; i < 2 * BENCH_BOX; i++) {
+		a[i] = (Uint32) rand() << 16 ^ rand();
+		b[i] = (Uint32) rand() << 16 ^ rand();
+	}
+
+	double pixels = (double) BENCH_ROUNDS * BENCH_BOX;
+	double t_ref = time_box(ref, a, b, box_run_scalar);
+
+	for (int k = 0; k < sizeof(kernel) / sizeof(kernel[0]); k++) {
+		if (!kernel[k].fn) {
+			printf("box %-8s unsupported\n", kernel[k].name);
+			continue;
+		}
+		double t = time_box(out, a, b, kernel[k].fn);
+		int same = !memcmp(ref, out, BENCH_BOX * sizeof(Uint32));
+		printf("box %-8s %8.2f ns/pixel %6.2fx %s\n",
+		       kernel[k].name,
+		       1e9 * t / pixels,
+		       t_ref / t,
+		       same ? "identical" : "MISMATCH");
+	}
+
+done:
+	free(a);
+	free(b);
+	free(ref);
+	free(out);
+}
+
+// Random strokes, from single dots up to half a cell
+void make_glyph (SDL_Surface *cell, unsigned char *mask, struct glyph **glyph_p)
+{
+	SDL_Rect rect;
+	SDL_Rect block = {0, 0, BENCH_W, BENCH_H};
+	Uint8 r, g, b;
+
+	SDL_FillRect(cell, NULL, TRANSPARENT_RGBA);
+	for (int n = 1 + rand() % 3; n > 0; n--) {
+		rect.w = 1 + rand() % (BENCH_W / 2);
+		rect.h = 1 + rand() % (BENCH_H / 2);
+		rect.x = rand() % (BENCH_W - rect.w);
+		rect.y = rand() % (BENCH_H - rect.h);
+		SDL_FillRect(cell, &rect, AMASK);
+	}
+
+	for (int y = 0; y < BENCH_H; y++) {
+		for (int x = 0; x < BENCH_W; x++) {
+			SDL_GetRGB(((Uint32 *) (cell->pixels + y * cell->pitch))[x],
+			           cell->format,
+			           &r, &g, &b);
+			mask[x + y * BENCH_W] = r + g + b < 0xff;
+		}
+	}
+
+	*glyph_p = get_glyph(cell, block);
+}
+
+// Cold loads with the cache bypassed. Lazy loads touch a few dozen
+// glyphs, as a typical document would.
+void bench_font (char *path)
+{
+	const char *name[] = {"eager", "lazy", "parallel"};
+	unsigned load[] = {FONT_EAGER, FONT_LAZY, FONT_PARALLEL};
+	struct font *font;
+	double start;
+
+	for (int k = 0; k < 3; k++) {
+		font_mode = load[k] | FONT_NO_CACHE;
+		start = now();
+		font = load_font(path);
+		if (!font) return;
+		if (load[k] == FONT_LAZY) {
+			for (int i = ' '; i < ' ' + 40; i++)
+				font_glyph(font, i);
+		}
+		printf("font %-8s %8.2f ms\n", name[k], 1e3 * (now() - start));
+		destroy_font(&font);
+	}
+}
+
+int main (int argc, char **args)
+{
+	SDL_Surface *ref = SDL_CreateRGBSurface(0, BENCH_W, BENCH_H, BITS_PER_PIXEL,
+	                                        RMASK, GMASK, BMASK, AMASK);
+	SDL_Surface *out = SDL_CreateRGBSurface(0, BENCH_W, BENCH_H, BITS_PER_PIXEL,
+	                                        RMASK, GMASK, BMASK, AMASK);
+	unsigned char *mask[BENCH_GLYPHS];
+	struct glyph *glyph[BENCH_GLYPHS];
+	struct cmy cmy[BENCH_GLYPHS];
+	size_t glyph_bytes = 0;
+
+	if (!ref || !out) {
+		fprintf(stderr,
+		        "Error creating SDL_Surface.\n"
+		        "SDL_Error: %s\n",
+		        SDL_GetError());
+		return 1;
+	}
+
+	srand(1);
+	for (int i = 0; i < BENCH_GLYPHS; i++) {
+		mask[i] = malloc(BENCH_W * BENCH_H);
+		make_glyph(out, mask[i], &glyph[i]);
+		glyph_bytes += glyph[i]->size;
+		cmy[i].c = rand();
+		cmy[i].m = rand();
+		cmy[i].y = rand();
+	}
+
+	init_blit();
+	init_pool();
+
+	if (argc > 1)
+		bench_font(args[1]);
+
+	struct {
+		const char *name;
+		run_fn fn;
+	} kernel[] = {
+		{"scalar", blit_run_scalar},
+#if defined(__x86_64__) || defined(__i386__)
+		{"sse2", SDL_HasSSE2() ? blit_run_sse2 : NULL},
+		{"avx2", SDL_HasAVX2() ? blit_run_avx2 : NULL},
+#endif
+		{"dispatch", blit_run},
+	};
+
+	double glyphs = (double) BENCH_ROUNDS * BENCH_GLYPHS;
+	double t_ref = time_kernel(ref, mask, glyph, cmy, NULL);
+
+	printf("glyph memory: %zu bytes compact, %d bytes per-pixel\n",
+	       glyph_bytes,
+	       BENCH_GLYPHS * BENCH_W * BENCH_H);
+	printf("%-10s %8.1f ns/glyph\n", "reference", 1e9 * t_ref / glyphs);
+
+	for (int k = 0; k < sizeof(kernel) / sizeof(kernel[0]); k++) {
+		if (!kernel[k].fn) {
+			printf("%-10s unsupported\n", kernel[k].name);
+			continue;
+		}
+		double t = time_kernel(out, mask, glyph, cmy, kernel[k].fn);
+		int same = !memcmp(ref->pixels, out->pixels, BENCH_H * ref->pitch);
+		printf("%-10s %8.1f ns/glyph %6.2fx %s\n",
+		       kernel[k].name,
+		       1e9 * t / glyphs,
+		       t_ref / t,
+		       same ? "identical" : "MISMATCH");
+	}
+
+	bench_box();
+
+	for (int i = 0; i < BENCH_GLYPHS; i++) {
+		free(mask[i]);
+		free(glyph[i]);
+	}
+	SDL_FreeSurface(ref);
+	SDL_FreeSurface(out);
+	cleanup_pool();
+
+	return 0;
+}
@@ -0,0 +1,226 @@
+#include <SDL2/SDL_image.h>
+#include <SDL2/SDL.h>
+#include <X11/Xlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ctype.h>
+#include <math.h>
+#include "type.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLIT_X86
+#endif
+
+void (*blit_run) (Uint32 *dest, int n, Uint32 sub);
+void (*box_run) (Uint32 *dest, Uint32 *a, Uint32 *b, int n);
+
+Uint32 cmy_to_sub (struct cmy cmy)
+{
+	return ((Uint32) cmy.c << RSHIFT) |
+	       ((Uint32) cmy.m << GSHIFT) |
+	       ((Uint32) cmy.y << BSHIFT);
+}
+
+// Saturating subtract of every colour channel, alpha forced opaque.
+// Matches the SDL_GetRGB/SDL_MapRGBA round trip for our 8888 format.
+static inline Uint32 sub_pixel (Uint32 p, Uint32 sub)
+{
+	Uint32 out = AMASK;
+	Uint32 a, b;
+
+	for (int shift = BSHIFT; shift <= RSHIFT; shift += 8) {
+		a = (p >> shift) & 0xff;
+		b = (sub >> shift) & 0xff;
+		if (a > b)
+			out |= (a - b) << shift;
+	}
+
+	return out;
+}
+
+void blit_run_scalar (Uint32 *dest, int n, Uint32 sub)
+{
+	for (int i = 0; i < n; i++)
+		dest[i] = sub_pixel(dest[i], sub);
+}
+
+#ifdef BLIT_X86
+__attribute__((target("sse2")))
+void blit_run_sse2 (Uint32 *dest, int n, Uint32 sub)
+{
+	const __m128i sub4 = _mm_set1_epi32(sub);
+	const __m128i alpha4 = _mm_set1_epi32(AMASK);
+	__m128i p;
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		p = _mm_loadu_si128((__m128i *) (dest + i));
+		p = _mm_or_si128(_mm_subs_epu8(p, sub4), alpha4);
+		_mm_storeu_si128((__m128i *) (dest + i), p);
+	}
+
+	blit_run_scalar(dest + i, n - i, sub);
+}
+
+__attribute__((target("avx2")))
+void blit_run_avx2 (Uint32 *dest, int n, Uint32 sub)
+{
+	const __m256i sub8 = _mm256_set1_epi32(sub);
+	const __m256i alpha8 = _mm256_set1_epi32(AMASK);
+	__m256i p;
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		p = _mm256_loadu_si256((__m256i *) (dest + i));
+		p = _mm256_or_si256(_mm256_subs_epu8(p, sub8), alpha8);
+		_mm256_storeu_si256((__m256i *) (dest + i), p);
+	}
+
+	// Avoid the AVX to legacy SSE transition penalty in the tail.
+	_mm256_zeroupper();
+	blit_run_sse2(dest + i, n - i, sub);
+}
+#endif
+
+// Each of the n pixels of dest is the rounded mean of a 2x2 square, two
+// pixels from row a over two from row b. All four channels are averaged;
+// transparent pixels are white, so the colour is what the square would
+// show over the sheet.
+void box_run_scalar (Uint32 *dest, Uint32 *a, Uint32 *b, int n)
+{
+	Uint32 out;
+	Uint32 sum;
+
+	for (int i = 0; i < n; i++) {
+		out = 0;
+		for (int shift = 0; shift < 32; shift += 8) {
+			sum = ((a[2 * i] >> shift) & 0xff) +
+			      ((a[2 * i + 1] >> shift) & 0xff) +
+			      ((b[2 * i] >> shift) & 0xff) +
+			      ((b[2 * i + 1] >> shift) & 0xff);
+			out |= ((sum + 2) >> 2) << shift;
+		}
+		dest[i] = out;
+	}
+}
+
+#ifdef BLIT_X86
+// Four pixels of a over four of b make two squares. Their channel means
+// come back as 16 bit values, one pixel per 64 bits.
+__attribute__((target("sse2")))
+static inline __m128i box_pairs_sse2 (__m128i a, __m128i b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+	                           _mm_unpacklo_epi8(b, zero));
+	__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+	                           _mm_unpackhi_epi8(b, zero));
+
+	lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+	hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+	lo = _mm_unpacklo_epi64(lo, hi);
+
+	return _mm_srli_epi16(_mm_add_epi16(lo, _mm_set1_epi16(2)), 2);
+}
+
+__attribute__((target("sse2")))
+void box_run_sse2 (Uint32 *dest, Uint32 *a, Uint32 *b, int n)
+{
+	__m128i p, q;
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		p = box_pairs_sse2(_mm_loadu_si128((__m128i *) (a + 2 * i)),
+		                   _mm_loadu_si128((__m128i *) (b + 2 * i)));
+		q = box_pairs_sse2(_mm_loadu_si128((__m128i *) (a + 2 * i + 4)),
+		                   _mm_loadu_si128((__m128i *) (b + 2 * i + 4)));
+		_mm_storeu_si128((__m128i *) (dest + i), _mm_packus_epi16(p, q));
+	}
+
+	box_run_scalar(dest + i, a + 2 * i, b + 2 * i, n - i);
+}
+
+// The same per 128 bit lane; packing leaves the 64 bit quarters in the
+// order 0, 2, 1, 3.
+__attribute__((target("avx2")))
+static inline __m256i box_pairs_avx2 (__m256i a, __m256i b)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero),
+	                              _mm256_unpacklo_epi8(b, zero));
+	__m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero),
+	                              _mm256_unpackhi_epi8(b, zero));
+
+	lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+	hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+	lo = _mm256_unpacklo_epi64(lo, hi);
+
+	return _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_set1_epi16(2)), 2);
+}
+
+__attribute__((target("avx2")))
+void box_run_avx2 (Uint32 *dest, Uint32 *a, Uint32 *b, int n)
+{
+	__m256i p, q;
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		p = box_pairs_avx2(_mm256_loadu_si256((__m256i *) (a + 2 * i)),
+		                   _mm256_loadu_si256((__m256i *) (b + 2 * i)));
+		q = box_pairs_avx2(_mm256_loadu_si256((__m256i *) (a + 2 * i + 8)),
+		                   _mm256_loadu_si256((__m256i *) (b + 2 * i + 8)));
+		p = _mm256_permute4x64_epi64(_mm256_packus_epi16(p, q), 0xd8);
+		_mm256_storeu_si256((__m256i *) (dest + i), p);
+	}
+
+	_mm256_zeroupper();
+	box_run_sse2(dest + i, a + 2 * i, b + 2 * i, n - i);
+}
+#endif
+
+void init_blit ()
+{
+	blit_run = blit_run_scalar;
+	box_run = box_run_scalar;
+#ifdef BLIT_X86
+	if (SDL_HasAVX2()) {
+		blit_run = blit_run_avx2;
+		box_run = box_run_avx2;
+	} else if (SDL_HasSSE2()) {
+		blit_run = blit_run_sse2;
+		box_run = box_run_sse2;
+	}
+#endif
+}
+
+// Composite a glyph into a block of h rows, shifted down by offset rows.
+// Only the spans the glyph actually inks are touched.
+void blit_glyph (Uint8 *pixels, int pitch, int h, struct glyph *glyph, Uint32 sub, int offset)
+{
+	Uint16 *rows = glyph_rows(glyph);
+	struct span *span = glyph_spans(glyph);
+	int at_y = glyph->y + offset;
+	int lo = 0;
+	int hi = glyph->h;
+	Uint32 *line;
+
+	if (at_y < 0)
+		lo = -at_y;
+	if (at_y + hi > h)
+		hi = h - at_y;
+
+	for (int y = lo; y < hi; y++) {
+		line = (Uint32 *) (pixels + (at_y + y) * pitch);
+		for (int s = rows[y]; s < rows[y + 1]; s++)
+			blit_run(line + span[s].x, span[s].w, sub);
+	}
+}
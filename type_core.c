@@ -9,7 +9,9 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <ctype.h>
 #include <math.h>
 #include "type.h"
@@ -18,18 +20,17 @@
 #define INIT_COLS 15
 #define INIT_ROWS 20
 
-#define BYTES_PER_PIXEL 4
-#define BITS_PER_PIXEL 32
-#define RMASK 0xff000000
-#define GMASK 0x00ff0000
-#define BMASK 0x0000ff00
-#define AMASK 0x000000ff
-#define TRANSPARENT_R 0xff
-#define TRANSPARENT_G 0xff
-#define TRANSPARENT_B 0xff
-#define TRANSPARENT_A 0x00
-#define TRANSPARENT_RGBA 0xffffffff
-#define TEXTURE_FORMAT SDL_PIXELFORMAT_RGBA32
+#define HUGE_PAGE_SIZE (2 << 20)
+#define SPILL_INIT_STROKES 256
+#define SPILL_MIN_CLASS 3
+#define SPILL_NONE 0xffffffff
+
+#define TEXTURE_BUDGET (256 << 20)
+#define EVICT_MARGIN 2
+
+#define SYN_BAND_ROWS 16
+#define SYN_READ_SIZE (1 << 16)
+#define SYN_BAND_SIZE 256
 
 struct palette *new_palette (unsigned char num_colors)
 {
@@ -86,192 +87,611 @@ void destroy_palette (struct palette **palette_p)
 	*palette_p = NULL;
 }
 
-unsigned char *get_glyph (SDL_Surface *img, SDL_Rect block)
-{
-	Uint8 *p;
-	Uint8 r, g, b;
-
-	unsigned char glyph_found = 0;
-	unsigned char *glyph;
-
-	for (unsigned char confirmed = 0; confirmed < 2; confirmed++) {
-		for (int y = 0; y < block.h; y++) {
-			p = img->pixels +
-			    (y + block.y) * img->pitch +
-			    block.x * BYTES_PER_PIXEL;
-			for (int x = 0; x < block.w; x++) {
-				SDL_GetRGB(*((Uint32 *)p),
-				           img->format,
-				           &r, &g, &b);
-				if (r + g + b >= 0xff) {
-					if (confirmed)
-						glyph[x + y * block.w] = 0;
-				} else {
-					if (confirmed) {
-						glyph[x + y * block.w] = 1;
-					} else {
-						glyph_found = 1;
-						// Short circuit the for loops
-						x = block.w;
-						y = block.h;
-					}
-				}
-				p += BYTES_PER_PIXEL;
-			}
-		}
+// Page aligned anonymous memory. Large arenas ask for transparent huge
+// pages.
+void *alloc_arena (size_t len)
+{
+	void *arena = mmap(NULL,
+	                   len,
+	                   PROT_READ | PROT_WRITE,
+	                   MAP_PRIVATE | MAP_ANONYMOUS,
+	                   -1,
+	                   0);
+
+	if (arena == MAP_FAILED)
+		return NULL;
 
-		if (!confirmed) {
-			if (!glyph_found)
-				return NULL;
+#ifdef MADV_HUGEPAGE
+	if (len >= HUGE_PAGE_SIZE)
+		madvise(arena, len, MADV_HUGEPAGE);
+#endif
 
-			glyph = malloc(block.w * block.h);
+	return arena;
+}
 
-			if (!glyph) {
-				fprintf(stderr,
-				        "Error allocating memory.\n"
-				        "Could not load glyph.\n");
-				return NULL;
-			}
-		}
-	}
+void free_arena (void *arena, size_t len)
+{
+	munmap(arena, len);
+}
 
-	return glyph;
+void fill_pixels (Uint8 *pixels, size_t len, Uint32 rgba)
+{
+	Uint32 *p = (Uint32 *) pixels;
+
+	for (size_t i = 0; i < len / BYTES_PER_PIXEL; i++)
+		p[i] = rgba;
 }
 
-struct font *load_font (unsigned char *path)
+// The one transparent block every blank position of a document shows.
+// It is mapped read-only, so drawing on it by mistake faults at once.
+Uint8 *new_blank (size_t len)
 {
-	if (!path) {
-		fprintf(stderr,
-		        "Path not given.\n"
-		        "Could not load font.\n");
+	Uint8 *blank = alloc_arena(len);
+
+	if (!blank)
 		return NULL;
-	}
 
-	SDL_Surface *img = IMG_Load(path);
+	fill_pixels(blank, len, TRANSPARENT_RGBA);
+	mprotect(blank, len, PROT_READ);
 
-	if (!img) {
-		fprintf(stderr,
-		        "Error loading image '%s'.\n"
-		        "IMG_Error: %s\n",
-		        path,
-		        IMG_GetError());
+	return blank;
+}
+
+// Tiles are found through a row of tiles_x pointers per tile row, the
+// row and the tile both allocated on first use. A tile nothing was
+// written to costs one pointer.
+struct tile *grid_tile (struct tile ***grid, int tiles_x, int x, int y, int make)
+{
+	struct tile **tile_row = grid[y];
+
+	if (!tile_row && make)
+		tile_row = grid[y] = calloc(tiles_x, sizeof(struct tile *));
+	if (!tile_row)
 		return NULL;
-	}
 
-	struct font *font = malloc(sizeof(struct font));
+	if (!tile_row[x] && make)
+		tile_row[x] = calloc(1, sizeof(struct tile));
 
-	if (!font) {
-		SDL_FreeSurface(img);
-		fprintf(stderr,
-		        "Error allocating memory.\n"
-		        "Could not load font '%s'.\n",
-		        path);
+	return tile_row[x];
+}
+
+struct tile *doc_tile (struct doc doc, int col, int row, int make)
+{
+	return grid_tile(doc.tile,
+	                 doc.tiles_x,
+	                 col / TILE_COLS,
+	                 row / TILE_ROWS,
+	                 make);
+}
+
+// Blocks in a tile are counted across, then down.
+static int tile_index (int col, int block_row)
+{
+	return col % TILE_COLS + block_row % (TILE_ROWS / 2) * TILE_COLS;
+}
+
+// The block showing an even row, doc.blank while it has no ink.
+Uint8 *block_pixels (struct doc doc, int col, int row)
+{
+	struct tile *tile = doc_tile(doc, col, row, 0);
+
+	if (!tile || !tile->block)
+		return doc.blank;
+
+	return tile->block[tile_index(col, row / 2)];
+}
+
+// Give block i of a tile pixels of its own to draw on.
+Uint8 *touch_tile_block (struct doc doc, struct tile *tile, int i)
+{
+	Uint8 *pixels;
+
+	if (!tile->block &&
+	    (tile->block = malloc(TILE_BLOCKS * sizeof(Uint8 *)))) {
+		for (int j = 0; j < TILE_BLOCKS; j++)
+			tile->block[j] = doc.blank;
+	}
+	if (!tile->block)
 		return NULL;
+
+	if (tile->block[i] == doc.blank) {
+		pixels = aligned_alloc(CACHE_LINE, doc.block_size);
+		if (!pixels)
+			return NULL;
+		fill_pixels(pixels, doc.block_size, TRANSPARENT_RGBA);
+		tile->block[i] = pixels;
 	}
 
-	font->ref = 1;
-	font->w = img->w / 16;
-	font->h = img->h / 16;
+	return tile->block[i];
+}
 
-	if (!font->w || !font->h) {
-		fprintf(stderr,
-		        "Glyphs are too small.\n"
-		        "Could not load font '%s'.\n",
-		        path);
-		SDL_FreeSurface(img);
-		free(font);
+// Hand a block that no longer shows any ink back to doc.blank.
+void release_tile_block (struct doc doc, struct tile *tile, int i)
+{
+	if (!tile->block || tile->block[i] == doc.blank)
+		return;
+
+	free(tile->block[i]);
+	tile->block[i] = doc.blank;
+}
+
+Uint8 *touch_block (struct doc doc, int col, int row)
+{
+	struct tile *tile = doc_tile(doc, col, row, 1);
+
+	if (!tile)
 		return NULL;
+
+	return touch_tile_block(doc, tile, tile_index(col, row / 2));
+}
+
+void release_block (struct doc doc, int col, int row)
+{
+	struct tile *tile = doc_tile(doc, col, row, 0);
+
+	if (tile)
+		release_tile_block(doc, tile, tile_index(col, row / 2));
+}
+
+struct marks *new_marks (int tiles_x)
+{
+	struct marks *marks = malloc(sizeof(struct marks));
+
+	if (!marks) return NULL;
+
+	marks->tiles_x = tiles_x;
+	marks->len = 0;
+	marks->size = 0;
+	marks->tile = NULL;
+	marks->num_slots = 0;
+	marks->slot = NULL;
+	marks->last = 0;
+
+	return marks;
+}
+
+void destroy_marks (struct marks **marks_p)
+{
+	struct marks *marks = *marks_p;
+	if (!marks) return;
+
+	free(marks->tile);
+	free(marks->slot);
+	free(marks);
+
+	*marks_p = NULL;
+}
+
+// Slots hold an entry's index plus one, 0 when free. Probing is linear
+// and entries are only ever removed all at once.
+static int *mark_slot (struct marks *marks, int x, int y)
+{
+	Uint64 key = (Uint64) y * marks->tiles_x + x;
+	Uint32 mask = marks->num_slots - 1;
+	Uint32 i = (Uint32) (key * 0x9e3779b97f4a7c15ull >> 32) & mask;
+	struct marked *tile;
+
+	for (; marks->slot[i]; i = (i + 1) & mask) {
+		tile = marks->tile + marks->slot[i] - 1;
+		if (tile->x == x && tile->y == y)
+			break;
 	}
 
-	SDL_Rect block = {0, 0, font->w, font->h};
+	return marks->slot + i;
+}
+
+// Keep the table at most half full.
+static int grow_slots (struct marks *marks)
+{
+	int num_slots = marks->num_slots ? 2 * marks->num_slots : 64;
+	int *slot = calloc(num_slots, sizeof(int));
+
+	if (!slot)
+		return 0;
+
+	free(marks->slot);
+	marks->slot = slot;
+	marks->num_slots = num_slots;
+	for (int i = 0; i < marks->len; i++)
+		*mark_slot(marks, marks->tile[i].x, marks->tile[i].y) = i + 1;
 
-	for (int j = 0; j < 16; j++) {
-		for (int i = 0; i < 16; i++) {
-			block.x = (i * img->w) / 16;
-			block.y = (j * img->h) / 16;
-			font->glyph[i + j * 16] = get_glyph(img, block);
+	return 1;
+}
+
+// Mark the block at col of a block row. Returns 0 if there was no memory
+// to remember it.
+int mark_block (struct marks *marks, int col, int row)
+{
+	int x = col / TILE_COLS;
+	int y = row / (TILE_ROWS / 2);
+	int i = tile_index(col, row);
+	struct marked *tile;
+	int *slot;
+	int size;
+
+	// Marks mostly come in runs along a tile.
+	if (marks->last < marks->len &&
+	    marks->tile[marks->last].x == x &&
+	    marks->tile[marks->last].y == y) {
+		marks->tile[marks->last].bits[i / 64] |= 1ull << (i % 64);
+		return 1;
+	}
+
+	if (2 * (marks->len + 1) > marks->num_slots && !grow_slots(marks))
+		return 0;
+
+	slot = mark_slot(marks, x, y);
+	if (!*slot) {
+		if (marks->len == marks->size) {
+			size = marks->size ? 2 * marks->size : 64;
+			tile = realloc(marks->tile, size * sizeof(struct marked));
+			if (!tile)
+				return 0;
+			marks->tile = tile;
+			marks->size = size;
 		}
+		tile = marks->tile + marks->len++;
+		tile->x = x;
+		tile->y = y;
+		memset(tile->bits, 0, sizeof(tile->bits));
+		*slot = marks->len;
 	}
 
-	return font;
+	marks->last = *slot - 1;
+	marks->tile[marks->last].bits[i / 64] |= 1ull << (i % 64);
+
+	return 1;
 }
 
-struct font *copy_font (struct font *font)
+int compare_marked (const void *a, const void *b)
 {
-	if (font) font->ref += 1;
-	return font;
+	const struct marked *p = a;
+	const struct marked *q = b;
+
+	if (p->y != q->y)
+		return p->y < q->y ? -1 : 1;
+	return (p->x > q->x) - (p->x < q->x);
 }
 
-void destroy_font (struct font **font_p)
+// Order the entries across, then down. This breaks the hash, so only
+// clear_marks may follow.
+void sort_marks (struct marks *marks)
 {
-	struct font *font = *font_p;
-	if (!font) return;
+	if (marks->len)
+		qsort(marks->tile, marks->len, sizeof(struct marked),
+			compare_marked);
+}
 
-	*font_p = NULL;
+void clear_marks (struct marks *marks)
+{
+	if (marks->len)
+		memset(marks->slot, 0, marks->num_slots * sizeof(int));
+	marks->len = 0;
+	marks->last = 0;
+}
 
-	font->ref -= 1;
-	if (font->ref)
-		return;
-	if (font->glyph) {
-		for (unsigned i = 0; i < 256; i++) {
-			if (font->glyph[i])
-				free(font->glyph[i]);
+// Column and block row of bit b of a marked tile.
+static int marked_col (struct marked *tile, int b)
+{
+	return tile->x * TILE_COLS + b % TILE_COLS;
+}
+
+static int marked_row (struct marked *tile, int b)
+{
+	return tile->y * (TILE_ROWS / 2) + b / TILE_COLS;
+}
+
+// The runs of marked blocks in one block row of n marked tiles that share
+// a tile row, sorted across. Returns how many there are.
+int marked_runs (struct marked *tile, int n, int row, SDL_Rect *run)
+{
+	int shift = row % (TILE_ROWS / 2) * TILE_COLS;
+	int num_runs = 0;
+	Uint64 bits;
+	int col;
+
+	for (int k = 0; k < n; k++) {
+		bits = tile[k].bits[shift / 64] >> shift % 64 &
+		       ((1ull << TILE_COLS) - 1);
+		for (; bits; bits &= bits - 1) {
+			col = tile[k].x * TILE_COLS + __builtin_ctzll(bits);
+			if (num_runs &&
+			    run[num_runs - 1].x + run[num_runs - 1].w == col) {
+				run[num_runs - 1].w++;
+				continue;
+			}
+			run[num_runs].x = col;
+			run[num_runs].y = row;
+			run[num_runs].w = 1;
+			run[num_runs].h = 1;
+			num_runs++;
 		}
-		free(font->glyph);
 	}
-	free(font);
+
+	return num_runs;
 }
 
-void destroy_doc (struct doc *doc)
+struct spill *new_spill ()
 {
-	destroy_font(&doc->font);
-	destroy_palette(&doc->palette);
+	struct spill *spill = malloc(sizeof(struct spill));
 
-	struct stroke *next;
+	if (!spill) return NULL;
 
-	if (doc->stroke) {
-		for (int j = 0; j < doc->rows; j++) {
-			for (int i = 0; i < doc->cols; i++) {
-				for (struct stroke *stroke =
-					doc->stroke[i + j * doc->cols];
-				     stroke;
-				     stroke = next) {
-					next = stroke->next;
-				}
-			}
-		}
-		free(doc->stroke);
-		doc->stroke = NULL;
+	spill->stroke = NULL;
+	spill->len = 0;
+	spill->size = 0;
+	for (int i = 0; i < 32; i++)
+		spill->free[i] = SPILL_NONE;
+
+	return spill;
+}
+
+void destroy_spill (struct spill **spill_p)
+{
+	struct spill *spill = *spill_p;
+	if (!spill) return;
+
+	if (spill->stroke)
+		free(spill->stroke);
+	free(spill);
+
+	*spill_p = NULL;
+}
+
+// Spilled stacks live in power of two runs of the pool, 8 strokes or
+// more, found by the size class of the stack length.
+int spill_class (Uint32 len)
+{
+	int class = SPILL_MIN_CLASS;
+
+	while ((1u << class) < len)
+		class++;
+
+	return class;
+}
+
+Uint32 spill_alloc (struct spill *spill, int class)
+{
+	Uint32 at = spill->free[class];
+
+	if (at != SPILL_NONE) {
+		memcpy(&spill->free[class], spill->stroke + at, sizeof(Uint32));
+		return at;
+	}
+
+	Uint32 n = 1u << class;
+
+	if (spill->len + n > spill->size) {
+		Uint32 size = spill->size ? spill->size : SPILL_INIT_STROKES;
+		while (spill->len + n > size)
+			size *= 2;
+		struct stroke *stroke = realloc(spill->stroke,
+		                                size * sizeof(struct stroke));
+		if (!stroke) return SPILL_NONE;
+		spill->stroke = stroke;
+		spill->size = size;
+	}
+
+	at = spill->len;
+	spill->len += n;
+
+	return at;
+}
+
+void spill_free (struct spill *spill, Uint32 at, int class)
+{
+	memcpy(spill->stroke + at, &spill->free[class], sizeof(Uint32));
+	spill->free[class] = at;
+}
+
+// Cells of tiles never written to read as this one. Only touch_cell
+// hands out cells that may be changed.
+struct cell blank_cell;
+
+struct cell *doc_cell (struct doc doc, int col, int row)
+{
+	struct tile *tile = doc_tile(doc, col, row, 0);
+
+	if (!tile || !tile->cell)
+		return &blank_cell;
+
+	return tile->cell + col % TILE_COLS + row % TILE_ROWS * TILE_COLS;
+}
+
+struct cell *touch_cell (struct doc doc, int col, int row)
+{
+	struct tile *tile = doc_tile(doc, col, row, 1);
+
+	if (tile && !tile->cell)
+		tile->cell = calloc(TILE_COLS * TILE_ROWS, sizeof(struct cell));
+	if (!tile || !tile->cell)
+		return NULL;
+
+	return doc_cell(doc, col, row);
+}
+
+// Strokes of a cell, bottom first. The top of the stack is the last one.
+struct stroke *cell_strokes (struct doc doc, struct cell *cell)
+{
+	if (cell->len > CELL_INLINE)
+		return doc.spill->stroke + cell->spill;
+	return cell->stroke;
+}
+
+int cell_push (struct doc doc, struct cell *cell, struct stroke stroke)
+{
+	Uint32 at;
+	int class;
+
+	if (cell->len < CELL_INLINE) {
+		cell->stroke[cell->len++] = stroke;
+		return 1;
+	}
+
+	if (cell->len == CELL_INLINE) {
+		at = spill_alloc(doc.spill, SPILL_MIN_CLASS);
+		if (at == SPILL_NONE) return 0;
+		memcpy(doc.spill->stroke + at,
+		       cell->stroke,
+		       CELL_INLINE * sizeof(struct stroke));
+		cell->spill = at;
+	} else if (cell->len == 1u << (class = spill_class(cell->len))) {
+		at = spill_alloc(doc.spill, class + 1);
+		if (at == SPILL_NONE) return 0;
+		memcpy(doc.spill->stroke + at,
+		       doc.spill->stroke + cell->spill,
+		       cell->len * sizeof(struct stroke));
+		spill_free(doc.spill, cell->spill, class);
+		cell->spill = at;
+	}
+
+	doc.spill->stroke[cell->spill + cell->len++] = stroke;
+
+	return 1;
+}
+
+// A stack's run always matches the size class of its length. Popping
+// across a power of two hands the upper half of the run back in place.
+void cell_pop (struct doc doc, struct cell *cell)
+{
+	if (!cell->len) return;
+
+	Uint32 len = cell->len - 1;
+	Uint32 at = cell->spill;
+	int class;
+
+	if (len == CELL_INLINE) {
+		memcpy(cell->stroke,
+		       doc.spill->stroke + at,
+		       CELL_INLINE * sizeof(struct stroke));
+		spill_free(doc.spill, at, spill_class(cell->len));
+	} else if (len > CELL_INLINE &&
+	           spill_class(len) < (class = spill_class(cell->len))) {
+		spill_free(doc.spill, at + (1u << (class - 1)), class - 1);
+	}
+
+	cell->len = len;
+}
+
+struct upload *new_upload (int cols, int rows)
+{
+	struct upload *upload = malloc(sizeof(struct upload));
+
+	if (!upload) return NULL;
+
+	upload->back = 0;
+	upload->num_open = 0;
+	upload->num_resident = 0;
+	upload->size_resident = 0;
+	upload->resident = NULL;
+	upload->open = malloc(cols * sizeof(SDL_Rect));
+	upload->run = malloc(cols * sizeof(SDL_Rect));
+	for (int i = 0; i < 2; i++)
+		upload->dirty[i] = new_marks((cols + TILE_COLS - 1) / TILE_COLS);
+
+	if (!upload->open || !upload->run ||
+	    !upload->dirty[0] || !upload->dirty[1]) {
+		destroy_upload(&upload);
+		return NULL;
 	}
 
-	if (doc->surface) {
-		if (doc->pixels && doc->pixels[0])
-			doc->surface->pixels = doc->pixels[0];
-		SDL_FreeSurface(doc->surface);
-		doc->surface = NULL;
+	return upload;
+}
+
+void destroy_upload (struct upload **upload_p)
+{
+	struct upload *upload = *upload_p;
+	if (!upload) return;
+
+	free(upload->open);
+	free(upload->run);
+	destroy_marks(&upload->dirty[0]);
+	destroy_marks(&upload->dirty[1]);
+	free(upload->resident);
+	free(upload);
+
+	*upload_p = NULL;
+}
+
+struct batch *new_batch (int tiles_x)
+{
+	struct batch *batch = malloc(sizeof(struct batch));
+
+	if (!batch) return NULL;
+
+	batch->depth = 0;
+	batch->stale = new_marks(tiles_x);
+
+	if (!batch->stale) {
+		destroy_batch(&batch);
+		return NULL;
 	}
 
-	if (doc->pixels) {
-		for (unsigned i = 1; i < doc->num_blocks; i++) {
-			if (doc->pixels[i])
-				free(doc->pixels[i]);
+	return batch;
+}
+
+void destroy_batch (struct batch **batch_p)
+{
+	struct batch *batch = *batch_p;
+	if (!batch) return;
+
+	destroy_marks(&batch->stale);
+	free(batch);
+
+	*batch_p = NULL;
+}
+
+// Free a grid of tiles with everything in them.
+void destroy_tiles (struct doc doc, struct tile ***tile, int tiles_x, int tiles_y)
+{
+	struct tile *t;
+
+	for (int y = 0; tile && y < tiles_y; y++) {
+		for (int x = 0; tile[y] && x < tiles_x; x++) {
+			t = tile[y][x];
+			if (!t)
+				continue;
+			free(t->cell);
+			if (t->texture)
+				SDL_DestroyTexture(t->texture);
+			for (int i = 0; t->block && i < TILE_BLOCKS; i++) {
+				if (t->block[i] != doc.blank)
+					free(t->block[i]);
+			}
+			free(t->block);
+			free(t);
 		}
-		free(doc->pixels);
-		doc->pixels = NULL;
+		free(tile[y]);
 	}
+	free(tile);
+}
 
-	if (doc->texture) {
-		SDL_DestroyTexture(doc->texture);
-		doc->texture = NULL;
+void destroy_doc (struct doc *doc)
+{
+	destroy_font(&doc->font);
+	destroy_palette(&doc->palette);
+
+	destroy_lods(doc);
+	destroy_tiles(*doc, doc->tile, doc->tiles_x, doc->tiles_y);
+	doc->tile = NULL;
+
+	if (doc->blank) {
+		free_arena(doc->blank, doc->block_size);
+		doc->blank = NULL;
 	}
 
+	destroy_spill(&doc->spill);
+
+	destroy_upload(&doc->upload);
+	destroy_batch(&doc->batch);
+
 	doc->cols = 0;
 	doc->rows = 0;
 }
 
 struct doc new_doc (struct font *font, struct palette *palette, int cols, int rows)
 {
-	struct doc doc;
+	struct doc doc = {0};
 
 	if (!font || !palette) {
 		fprintf(stderr,
@@ -284,9 +704,16 @@ struct doc new_doc (struct font *font, struct palette *palette, int cols, int ro
 	doc.cols = cols;
 	doc.rows = rows;
 
-	doc.stroke = calloc(cols * rows, sizeof(struct stroke *));
+	doc.pitch = font->w * BYTES_PER_PIXEL;
+	doc.block_size = (font->h * doc.pitch + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+	doc.tiles_x = (cols + TILE_COLS - 1) / TILE_COLS;
+	doc.tiles_y = ((rows + 2) / 2 + TILE_ROWS / 2 - 1) / (TILE_ROWS / 2);
+	doc.tile = calloc(doc.tiles_y, sizeof(struct tile **));
+	doc.blank = new_blank(doc.block_size);
+	doc.spill = new_spill();
+	doc.batch = new_batch(doc.tiles_x);
 
-	if (!doc.stroke) {
+	if (!doc.tile || !doc.blank || !doc.spill || !doc.batch) {
 		destroy_doc(&doc);
 		fprintf(stderr,
 		        "Error allocating memory.\n"
@@ -294,59 +721,9 @@ struct doc new_doc (struct font *font, struct palette *palette, int cols, int ro
 		return doc;
 	}
 
-	doc.surface = SDL_CreateRGBSurface(0,
-	                                   font->w,
-	                                   font->h,
-	                                   BITS_PER_PIXEL,
-	                                   RMASK,
-	                                   GMASK,
-	                                   BMASK,
-	                                   AMASK);
-	SDL_SetColorKey(doc.surface, SDL_TRUE, TRANSPARENT_RGBA);
-
-	if (!doc.surface) {
-		destroy_doc(&doc);
-		fprintf(stderr,
-		        "Error creating SDL_Surface.\n"
-		        "SDL_Error: %s\n",
-		        "Could not create document.\n",
-		        SDL_GetError);
-		return doc;
-	}
-
-	doc.num_blocks = cols * ((rows + 2) / 2);
-	doc.pixels = malloc(doc.num_blocks * sizeof(Uint8 *));
-
-	if (!doc.pixels) {
-		destroy_doc(&doc);
-		fprintf(stderr,
-		        "Error allocating memory.\n"
-		        "Could not create document.\n");
-		return doc;
-	}
-
-	doc.pixels[0] = doc.surface->pixels;
-	SDL_FillRect(doc.surface, NULL, TRANSPARENT_RGBA);
-
-	for (unsigned i = 1; i < doc.num_blocks; i++) {
-		doc.pixels[i] = calloc(font->h * doc.surface->pitch,
-		                       sizeof(Uint8));
-		if (!doc.pixels[i]) {
-			destroy_doc(&doc);
-			fprintf(stderr,
-			        "Could not create document.\n"
-			        "SDL_Error: %s.\n",
-			        SDL_GetError());
-			return doc;
-		}
-
-		doc.surface->pixels = doc.pixels[i];
-		SDL_FillRect(doc.surface, NULL, TRANSPARENT_RGBA);
-	}
-
-	doc.texture = NULL;
 	doc.texture_w = 0;
 	doc.texture_h = 0;
+	doc.upload = NULL;
 
 	return doc;
 }
@@ -416,24 +793,11 @@ void update_selection (struct select *select)
 	select->rect.y += frame.y;
 }
 
+// Tab stops are placed when drawn, only the margin moves with the frame.
 void update_margins ()
 {
 	if (!curbuf) return;
 
-	for (int i = 0; i < curbuf->doc.rows; i++) {
-		if (curbuf->v_tab[i])
-			curbuf->v_tab[i] = frame.y +
-				(int) floor(curbuf->cam_z *
-				            (double) (i * curbuf->doc.font->h) /
-					    2.0);
-	}
-	for (int i = 0; i < curbuf->doc.cols; i++) {
-		if (curbuf->h_tab[i])
-			curbuf->h_tab[i] = frame.x +
-				(int) floor(curbuf->cam_z *
-				            (double) (i * curbuf->doc.font->w));
-	}
-
 	curbuf->margin.x = frame.x +
 	                   (int) floor(curbuf->cam_z *
 	                               (double) (curbuf->left_margin *
@@ -452,6 +816,63 @@ void update_margins ()
 	                                        curbuf->doc.font->h) / 2.0);
 }
 
+// Index of the first tab stop at or after at.
+int find_tab (struct tabs *tabs, int at)
+{
+	int lo = 0;
+	int hi = tabs->len;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (tabs->at[mid] < at) {
+			lo = mid + 1;
+		} else hi = mid;
+	}
+
+	return lo;
+}
+
+int set_tab (struct tabs *tabs, int at, int on)
+{
+	int i = find_tab(tabs, at);
+	int *at_p;
+	int size;
+
+	if (i < tabs->len && tabs->at[i] == at) {
+		if (on)
+			return 1;
+		memmove(tabs->at + i,
+		        tabs->at + i + 1,
+		        (tabs->len - i - 1) * sizeof(int));
+		tabs->len--;
+		return 1;
+	}
+	if (!on)
+		return 1;
+
+	if (tabs->len == tabs->size) {
+		size = tabs->size ? 2 * tabs->size : 16;
+		at_p = realloc(tabs->at, size * sizeof(int));
+		if (!at_p) {
+			fprintf(stderr,
+			        "Error allocating memory.\n"
+			        "Could not set tab stop.\n");
+			return 0;
+		}
+		tabs->at = at_p;
+		tabs->size = size;
+	}
+
+	memmove(tabs->at + i + 1,
+	        tabs->at + i,
+	        (tabs->len - i) * sizeof(int));
+	tabs->at[i] = at;
+	tabs->len++;
+
+	return 1;
+}
+
 void update_frame ()
 {
 	if (!window || !curbuf)
@@ -487,52 +908,576 @@ void update_cursor_rgb ()
 	cursor_rgb.b = 0xff - cmy.y;
 }
 
-void zoom_to_fit (struct buffer *buf)
+void zoom_to_fit (struct buffer *buf)
+{
+	if (!window || !buf)
+		return;
+
+	SDL_Surface *screen = SDL_GetWindowSurface(window);
+
+	double zoom_x = (double) screen->w / (double) buf->doc.texture_w;
+	double zoom_y = (double) screen->h / (double) buf->doc.texture_h;
+
+	buf->cam_z = (zoom_x < zoom_y) ? zoom_x : zoom_y;
+	buf->cam_x = (double) buf->doc.texture_w / 2.0;
+	buf->cam_y = (double) buf->doc.texture_h / 2.0;
+
+	update_frame();
+}
+
+// The pyramid has levels until one tile holds the whole document.
+// Blocks drawn before it existed go up on the next flush.
+int new_lods (struct doc *doc)
+{
+	struct lod *lod;
+	Uint8 **block;
+	int cols = doc->cols;
+	int rows = (doc->rows + 2) / 2;
+	int num_lods = 0;
+
+	while (cols > TILE_COLS || rows > TILE_ROWS / 2) {
+		cols = (cols + 1) / 2;
+		rows = (rows + 1) / 2;
+		num_lods++;
+	}
+
+	doc->lod = calloc(num_lods + 1, sizeof(struct lod));
+	if (!doc->lod)
+		return 0;
+	doc->num_lods = num_lods;
+
+	cols = doc->cols;
+	rows = (doc->rows + 2) / 2;
+	for (int level = 0; level <= num_lods; level++) {
+		lod = doc->lod + level;
+		lod->cols = cols;
+		lod->rows = rows;
+		lod->tiles_x = (cols + TILE_COLS - 1) / TILE_COLS;
+		lod->tiles_y = (rows + TILE_ROWS / 2 - 1) / (TILE_ROWS / 2);
+		cols = (cols + 1) / 2;
+		rows = (rows + 1) / 2;
+
+		if (!level) {
+			lod->tile = doc->tile;
+			continue;
+		}
+		lod->tile = calloc(lod->tiles_y, sizeof(struct tile **));
+		lod->dirty = new_marks(lod->tiles_x);
+		if (!lod->tile || !lod->dirty) {
+			destroy_lods(doc);
+			return 0;
+		}
+	}
+
+	for (int y = 0; num_lods && y < doc->tiles_y; y++) {
+		for (int x = 0; doc->tile[y] && x < doc->tiles_x; x++) {
+			block = doc->tile[y][x] ? doc->tile[y][x]->block : NULL;
+			for (int i = 0; block && i < TILE_BLOCKS; i++) {
+				if (block[i] == doc->blank)
+					continue;
+				mark_lod(*doc,
+				         1,
+				         (x * TILE_COLS + i % TILE_COLS) / 2,
+				         (y * (TILE_ROWS / 2) + i / TILE_COLS) / 2);
+			}
+		}
+	}
+
+	return 1;
+}
+
+// Level 0 shares the document's tiles, which destroy_doc frees.
+void destroy_lods (struct doc *doc)
+{
+	struct lod *lod;
+
+	for (int level = 1; doc->lod && level <= doc->num_lods; level++) {
+		lod = doc->lod + level;
+		destroy_tiles(*doc, lod->tile, lod->tiles_x, lod->tiles_y);
+		destroy_marks(&lod->dirty);
+	}
+	free(doc->lod);
+	doc->lod = NULL;
+	doc->num_lods = 0;
+}
+
+struct tile *lod_tile (struct lod *lod, int x, int y, int make)
+{
+	return grid_tile(lod->tile, lod->tiles_x, x, y, make);
+}
+
+// A block of a level, doc.blank where nothing below it has ink.
+Uint8 *lod_pixels (struct doc *doc, int level, int col, int row)
+{
+	struct lod *lod = doc->lod + level;
+	struct tile *tile;
+
+	if (col >= lod->cols || row >= lod->rows)
+		return doc->blank;
+
+	tile = lod_tile(lod, col / TILE_COLS, row / (TILE_ROWS / 2), 0);
+	if (!tile || !tile->block)
+		return doc->blank;
+
+	return tile->block[tile_index(col, row)];
+}
+
+void mark_lod (struct doc doc, int level, int col, int row)
+{
+	if (!mark_block(doc.lod[level].dirty, col, row))
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Zoomed out view may be stale.\n");
+}
+
+// Box filter the 2x2 blocks below a block of the pyramid into it. Rows
+// and columns of the square straddle two blocks when the font size is
+// odd.
+void filter_block (struct doc *doc, int level, int col, int row)
+{
+	struct tile *tile = lod_tile(doc->lod + level,
+	                             col / TILE_COLS,
+	                             row / (TILE_ROWS / 2),
+	                             0);
+	int w = doc->font->w;
+	int h = doc->font->h;
+	Uint8 *child[4];
+	Uint8 *pixels;
+	Uint32 *src[2][2];
+	Uint32 a[2];
+	Uint32 b[2];
+	Uint32 *dest;
+	int blank = 1;
+	int y;
+
+	for (int i = 0; i < 4; i++) {
+		child[i] = lod_pixels(doc,
+		                      level - 1,
+		                      2 * col + i % 2,
+		                      2 * row + i / 2);
+		if (child[i] != doc->blank)
+			blank = 0;
+	}
+
+	if (blank) {
+		if (tile)
+			release_tile_block(*doc, tile, tile_index(col, row));
+		return;
+	}
+
+	pixels = tile ? touch_tile_block(*doc, tile, tile_index(col, row)) : NULL;
+	if (!pixels) {
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Could not draw zoomed out view.\n");
+		return;
+	}
+
+	for (int i = 0; i < h; i++) {
+		dest = (Uint32 *) (pixels + i * doc->pitch);
+		for (int j = 0; j < 2; j++) {
+			y = 2 * i + j;
+			src[j][0] = (Uint32 *) (child[2 * (y / h)] +
+			                        (y % h) * doc->pitch);
+			src[j][1] = (Uint32 *) (child[2 * (y / h) + 1] +
+			                        (y % h) * doc->pitch);
+		}
+		box_run(dest, src[0][0], src[1][0], w / 2);
+		if (w & 1) {
+			a[0] = src[0][0][w - 1];
+			a[1] = src[0][1][0];
+			b[0] = src[1][0][w - 1];
+			b[1] = src[1][1][0];
+			box_run(dest + w / 2, a, b, 1);
+		}
+		box_run(dest + (w + 1) / 2,
+		        src[0][1] + (w & 1),
+		        src[1][1] + (w & 1),
+		        w / 2);
+	}
+}
+
+struct filter {
+	struct doc *doc;
+	int level;
+};
+
+// One marked tile of a level per job. The tiles were made before any
+// job started, so a job only allocates inside its own.
+void filter_marked_tile (void *arg, int i)
+{
+	struct filter *filter = arg;
+	struct marked *tile = filter->doc->lod[filter->level].dirty->tile + i;
+	int b;
+
+	for (int k = 0; k < TILE_BLOCKS / 64; k++) {
+		for (Uint64 bits = tile->bits[k]; bits; bits &= bits - 1) {
+			b = k * 64 + __builtin_ctzll(bits);
+			filter_block(filter->doc,
+			             filter->level,
+			             marked_col(tile, b),
+			             marked_row(tile, b));
+		}
+	}
+}
+
+// Carry the blocks changed since the last flush up the pyramid a level
+// at a time, updating the textures of tiles that have one. Runs of
+// changed blocks in a row go up together.
+void flush_lods (struct doc *doc)
+{
+	struct filter filter = {doc, 0};
+	SDL_Rect *run = doc->upload->run;
+	struct marks *dirty;
+	struct marked *tile;
+	int num_runs;
+	int row;
+	int j;
+
+	for (int level = 1; level <= doc->num_lods; level++) {
+		dirty = doc->lod[level].dirty;
+		if (!dirty->len)
+			continue;
+
+		for (int i = 0; i < dirty->len; i++)
+			lod_tile(doc->lod + level, dirty->tile[i].x, dirty->tile[i].y, 1);
+
+		filter.level = level;
+		pool_run(dirty->len, filter_marked_tile, &filter);
+
+		sort_marks(dirty);
+		for (int i = 0; i < dirty->len; i = j) {
+			tile = dirty->tile + i;
+			for (j = i; j < dirty->len && dirty->tile[j].y == tile->y; j++);
+			for (int r = 0; r < TILE_ROWS / 2; r++) {
+				row = tile->y * (TILE_ROWS / 2) + r;
+				num_runs = marked_runs(tile, j - i, row, run);
+				for (int k = 0; k < num_runs; k++) {
+					upload_rect(doc, level, run[k]);
+					if (level == doc->num_lods)
+						continue;
+					for (int col = run[k].x; col < run[k].x + run[k].w; col++)
+						mark_lod(*doc, level + 1, col / 2, row / 2);
+				}
+			}
+		}
+		clear_marks(dirty);
+	}
+}
+
+// Start showing a document. Textures are only made for the tiles that
+// come into view, see show_doc.
+void render_doc (struct doc *doc)
+{
+	if (!doc->upload)
+		doc->upload = new_upload(doc->cols, doc->rows);
+	if (doc->upload && !doc->lod && !new_lods(doc))
+		destroy_upload(&doc->upload);
+
+	if (!doc->upload) {
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Unable to display buffer.\n");
+		return;
+	}
+
+	doc->texture_w = doc->font->w * doc->cols;
+	doc->texture_h = doc->font->h * (doc->rows + 1) / 2;
+}
+
+// Copy a rectangle of blocks of a level, given in block units and inside
+// the tile at x, y, into its texture under a single lock. Blocks are
+// already in the texture format.
+void upload_tile (struct doc *doc, int level, int x, int y, SDL_Rect blocks)
+{
+	SDL_Texture *texture = lod_tile(doc->lod + level, x, y, 0)->texture;
+	SDL_Rect rect = {(blocks.x - x * TILE_COLS) * doc->font->w,
+	                 (blocks.y - y * (TILE_ROWS / 2)) * doc->font->h,
+	                 blocks.w * doc->font->w,
+	                 blocks.h * doc->font->h};
+	int row_len = doc->font->w * BYTES_PER_PIXEL;
+	Uint8 *dest;
+	Uint8 *src;
+	int pitch;
+
+	if (SDL_LockTexture(texture, &rect, (void **) &dest, &pitch)) {
+		fprintf(stderr,
+		        "Could not update texture.\n"
+		        "SDL_Error: %s\n",
+		        SDL_GetError());
+		return;
+	}
+
+	for (int j = 0; j < blocks.h; j++) {
+		for (int i = 0; i < blocks.w; i++) {
+			src = lod_pixels(doc, level, blocks.x + i, blocks.y + j);
+			for (int y = 0; y < doc->font->h; y++) {
+				memcpy(dest + (j * doc->font->h + y) * pitch +
+				       i * row_len,
+				       src + y * doc->pitch,
+				       row_len);
+			}
+		}
+	}
+
+	SDL_UnlockTexture(texture);
+}
+
+// Copy a rectangle of blocks of a level into the textures of the tiles
+// it covers. Tiles without a texture are skipped, they go up whole once
+// in view.
+void upload_rect (struct doc *doc, int level, SDL_Rect blocks)
+{
+	int tile_rows = TILE_ROWS / 2;
+	struct tile *tile;
+	SDL_Rect part;
+	int end_x;
+	int end_y;
+
+	for (int y = blocks.y / tile_rows;
+	     y <= (blocks.y + blocks.h - 1) / tile_rows;
+	     y++) {
+		for (int x = blocks.x / TILE_COLS;
+		     x <= (blocks.x + blocks.w - 1) / TILE_COLS;
+		     x++) {
+			tile = lod_tile(doc->lod + level, x, y, 0);
+			if (!tile)
+				break;
+			if (!tile->texture)
+				continue;
+			part.x = x * TILE_COLS > blocks.x ? x * TILE_COLS : blocks.x;
+			part.y = y * tile_rows > blocks.y ? y * tile_rows : blocks.y;
+			end_x = (x + 1) * TILE_COLS;
+			end_y = (y + 1) * tile_rows;
+			if (end_x > blocks.x + blocks.w)
+				end_x = blocks.x + blocks.w;
+			if (end_y > blocks.y + blocks.h)
+				end_y = blocks.y + blocks.h;
+			part.w = end_x - part.x;
+			part.h = end_y - part.y;
+			upload_tile(doc, level, x, y, part);
+		}
+	}
+}
+
+// Extend the rectangles still open from the block row above with an
+// identical run below them and upload the rest. Both lists are sorted
+// by column; the runs become the open rectangles.
+void close_runs (struct doc *doc, SDL_Rect *run, int num_runs)
+{
+	struct upload *upload = doc->upload;
+	SDL_Rect *open = upload->open;
+
+	for (int i = 0, j = 0; i < upload->num_open; i++) {
+		while (j < num_runs && run[j].x < open[i].x)
+			j++;
+		if (j < num_runs &&
+		    run[j].x == open[i].x &&
+		    run[j].w == open[i].w) {
+			run[j].y = open[i].y;
+			run[j].h = open[i].h + 1;
+		} else upload_rect(doc, 0, open[i]);
+	}
+	memcpy(open, run, num_runs * sizeof(SDL_Rect));
+	upload->num_open = num_runs;
+}
+
+// Upload every dirty block once. Dirty runs in a block row are matched
+// against the rectangles still open from the row above, so a pasted or
+// loaded region goes up as a few large rectangles. Only tiles with dirty
+// blocks are visited. The marks are double buffered: blocks marked during
+// a flush wait for the next one.
+void flush_doc (struct doc *doc)
 {
-	if (!window || !buf)
-		return;
+	struct upload *upload = doc->upload;
 
-	SDL_Surface *screen = SDL_GetWindowSurface(window);
+	if (!upload)
+		return;
 
-	double zoom_x = (double) screen->w / (double) buf->doc.texture_w;
-	double zoom_y = (double) screen->h / (double) buf->doc.texture_h;
+	struct marks *dirty = upload->dirty[upload->back];
+	struct marked *tile;
+	int last_row = -2;
+	int num_runs;
+	int row;
+	int j;
+
+	upload->back = !upload->back;
+	upload->num_open = 0;
+
+	sort_marks(dirty);
+	for (int i = 0; i < dirty->len; i = j) {
+		tile = dirty->tile + i;
+		for (j = i; j < dirty->len && dirty->tile[j].y == tile->y; j++);
+		for (int r = 0; r < TILE_ROWS / 2; r++) {
+			row = tile->y * (TILE_ROWS / 2) + r;
+			num_runs = marked_runs(tile, j - i, row, upload->run);
+			if (!num_runs)
+				continue;
+			if (row != last_row + 1)
+				close_runs(doc, upload->run, 0);
+			close_runs(doc, upload->run, num_runs);
+			last_row = row;
+		}
+	}
+	close_runs(doc, upload->run, 0);
+	clear_marks(dirty);
 
-	buf->cam_z = (zoom_x < zoom_y) ? zoom_x : zoom_y;
-	buf->cam_x = (double) buf->doc.texture_w / 2.0;
-	buf->cam_y = (double) buf->doc.texture_h / 2.0;
+	flush_lods(doc);
+}
 
-	update_frame();
+void flush_uploads ()
+{
+	for (struct buffer *buf = allbuf; buf; buf = buf->next)
+		flush_doc(&buf->doc);
+	flush_doc(&clipboard);
 }
 
-void render_doc (struct doc *doc)
+// Make the texture of a tile of a level and fill it from the blocks.
+// Zoomed out levels are averaged over the white of the sheet already, so
+// they multiply onto it rather than blend.
+int build_tile (struct doc *doc, int level, int x, int y)
 {
-	doc->texture_w = doc->font->w * doc->cols;
-	doc->texture_h = doc->font->h * (doc->rows + 1) / 2;
-	doc->texture = SDL_CreateTexture(renderer,
-	                                     TEXTURE_FORMAT,
-	                                     SDL_TEXTUREACCESS_TARGET,
-	                                     doc->texture_w,
-	                                     doc->texture_h);
-	SDL_SetTextureBlendMode(doc->texture, SDL_BLENDMODE_BLEND);
-	if (!doc->texture) {
+	struct upload *upload = doc->upload;
+	struct tile *tile = lod_tile(doc->lod + level, x, y, 0);
+	SDL_Rect blocks = {x * TILE_COLS,
+	                   y * (TILE_ROWS / 2),
+	                   TILE_COLS,
+	                   TILE_ROWS / 2};
+	struct resident *resident;
+	int size;
+
+	if (upload->num_resident == upload->size_resident) {
+		size = upload->size_resident ? 2 * upload->size_resident : 16;
+		resident = realloc(upload->resident,
+		                   size * sizeof(struct resident));
+		if (!resident)
+			return 0;
+		upload->resident = resident;
+		upload->size_resident = size;
+	}
+
+	tile->texture = SDL_CreateTexture(renderer,
+	                                  TEXTURE_FORMAT,
+	                                  SDL_TEXTUREACCESS_STREAMING,
+	                                  TILE_COLS * doc->font->w,
+	                                  (TILE_ROWS / 2) * doc->font->h);
+	if (!tile->texture) {
 		fprintf(stderr,
 		        "Could not create texture.\n"
 		        "SDL_Error: %s\n",
-		        "Unable to display buffer.\n",
-			SDL_GetError());
-		return;
+		        SDL_GetError());
+		return 0;
+	}
+	SDL_SetTextureBlendMode(tile->texture,
+	                        level ? SDL_BLENDMODE_MOD : SDL_BLENDMODE_BLEND);
+	resident = upload->resident + upload->num_resident++;
+	resident->level = level;
+	resident->x = x;
+	resident->y = y;
+
+	upload_tile(doc, level, x, y, blocks);
+
+	return 1;
+}
+
+// Drop the textures of tiles of other levels, or more than EVICT_MARGIN
+// tiles outside the given range. Their blocks stay, so they can be built
+// again.
+void evict_tiles (struct doc *doc, int level,
+                  int lo_x, int lo_y, int hi_x, int hi_y)
+{
+	struct upload *upload = doc->upload;
+	struct resident *r;
+	struct tile *tile;
+
+	for (int i = 0; i < upload->num_resident;) {
+		r = upload->resident + i;
+		if (r->level == level &&
+		    r->x >= lo_x - EVICT_MARGIN && r->x <= hi_x + EVICT_MARGIN &&
+		    r->y >= lo_y - EVICT_MARGIN && r->y <= hi_y + EVICT_MARGIN) {
+			i++;
+			continue;
+		}
+		tile = lod_tile(doc->lod + r->level, r->x, r->y, 0);
+		SDL_DestroyTexture(tile->texture);
+		tile->texture = NULL;
+		*r = upload->resident[--upload->num_resident];
 	}
+}
 
-	SDL_SetRenderTarget(renderer, doc->texture);
-	SDL_SetRenderDrawColor(renderer,
-	                       TRANSPARENT_R,
-	                       TRANSPARENT_G,
-	                       TRANSPARENT_B,
-	                       TRANSPARENT_A);
-	SDL_RenderClear(renderer);
-	SDL_SetRenderTarget(renderer, NULL);
+// Draw the tiles of a document that are inside the window, dest being
+// where the whole document goes. The level is the most zoomed out one
+// whose pixels are still no smaller than the screen's. Tiles with ink get
+// a texture the first time they are in view. Past TEXTURE_BUDGET, tiles
+// far out of view lose theirs, and tiles that still do not fit are left
+// out until they do.
+void show_doc (struct doc *doc, SDL_Rect *dest)
+{
+	SDL_Surface *screen = SDL_GetWindowSurface(window);
+	struct lod *lod;
+	double tile_w;
+	double tile_h;
+	double zoom_x;
+	double zoom_y;
+	int level;
+	int lo_x, lo_y;
+	int hi_x, hi_y;
+	int max_resident;
+	struct tile *tile;
+	SDL_Rect to;
+
+	if (!doc->tile || !doc->cols)
+		return;
+	if (!doc->upload)
+		render_doc(doc);
+	if (!doc->upload || dest->w <= 0 || dest->h <= 0)
+		return;
 
-	draw_doc(*doc);
+	zoom_x = (double) dest->w / (double) doc->texture_w;
+	zoom_y = (double) dest->h / (double) doc->texture_h;
+	for (level = 0;
+	     level < doc->num_lods && zoom_x * (2 << level) <= 1.0;
+	     level++);
+	lod = doc->lod + level;
+
+	tile_w = (double) (TILE_COLS * doc->font->w << level);
+	tile_h = (double) ((TILE_ROWS / 2) * doc->font->h << level);
+	lo_x = (int) floor((double) -dest->x / zoom_x / tile_w);
+	lo_y = (int) floor((double) -dest->y / zoom_y / tile_h);
+	hi_x = (int) ceil((double) (screen->w - dest->x) / zoom_x / tile_w) - 1;
+	hi_y = (int) ceil((double) (screen->h - dest->y) / zoom_y / tile_h) - 1;
+	if (lo_x < 0) lo_x = 0;
+	if (lo_y < 0) lo_y = 0;
+	if (hi_x >= lod->tiles_x) hi_x = lod->tiles_x - 1;
+	if (hi_y >= lod->tiles_y) hi_y = lod->tiles_y - 1;
+
+	max_resident = TEXTURE_BUDGET / (TILE_COLS * doc->font->w *
+	                                 (TILE_ROWS / 2) * doc->font->h *
+	                                 BYTES_PER_PIXEL);
+	if (max_resident < 1)
+		max_resident = 1;
+	if (doc->upload->num_resident >= max_resident)
+		evict_tiles(doc, level, lo_x, lo_y, hi_x, hi_y);
+
+	for (int y = lo_y; y <= hi_y; y++) {
+		for (int x = lo_x; lod->tile[y] && x <= hi_x; x++) {
+			tile = lod->tile[y][x];
+			if (!tile || !tile->block)
+				continue;
+			if (!tile->texture &&
+			    (doc->upload->num_resident >= max_resident ||
+			     !build_tile(doc, level, x, y)))
+				continue;
+
+			// Edges are rounded in document space, so
+			// neighbouring tiles meet without gaps.
+			to.x = dest->x + (int) round(zoom_x * tile_w * x);
+			to.y = dest->y + (int) round(zoom_y * tile_h * y);
+			to.w = dest->x + (int) round(zoom_x * tile_w * (x + 1)) - to.x;
+			to.h = dest->y + (int) round(zoom_y * tile_h * (y + 1)) - to.y;
+			SDL_RenderCopy(renderer, tile->texture, NULL, &to);
+		}
+	}
 }
 
 void choose_buffer (struct buffer *buf)
@@ -540,13 +1485,12 @@ void choose_buffer (struct buffer *buf)
 	if (!buf)
 		return;
 
-	if (window && !buf->doc.texture)
+	if (window && !buf->doc.upload)
 		render_doc(&buf->doc);
 
 	curbuf = buf;
 
 	if (window) {
-		texture = buf->doc.texture;
 		update_frame();
 		update_cursor_rgb();
 	}
@@ -579,6 +1523,8 @@ void destroy_buffer (struct buffer **buf_p)
 	}
 
 	destroy_doc(&buf->doc);
+	free(buf->h_tab.at);
+	free(buf->v_tab.at);
 
 	*buf_p = NULL;
 }
@@ -587,15 +1533,8 @@ struct buffer *new_buffer (struct font *font, struct palette *palette,
                            int cols, int rows)
 {
 	struct buffer *buf = malloc(sizeof(struct buffer));
-	buf->h_tab = calloc(cols, sizeof(int));
-	buf->v_tab = calloc(rows, sizeof(int));
-
-	if (!buf || !buf->h_tab || !buf->v_tab) {
-		if (buf) {
-			if (buf->h_tab) free(buf->h_tab);
-			if (buf->v_tab) free(buf->v_tab);
-			free(buf);
-		}
+
+	if (!buf) {
 		fprintf(stderr,
 		        "Error allocating memory.\n"
 		        "Could not add buffer.\n");
@@ -609,6 +1548,13 @@ struct buffer *new_buffer (struct font *font, struct palette *palette,
 		return NULL;
 	}
 
+	buf->h_tab.len = 0;
+	buf->h_tab.size = 0;
+	buf->h_tab.at = NULL;
+	buf->v_tab.len = 0;
+	buf->v_tab.size = 0;
+	buf->v_tab.at = NULL;
+
 	buf->top_margin = 0;
 	buf->bottom_margin = rows;
 	buf->left_margin = 0;
@@ -622,8 +1568,8 @@ struct buffer *new_buffer (struct font *font, struct palette *palette,
 	buf->ptr_row = 0;
 	buf->color = 0;
 
-	buf->cam_x = (double) buf->doc.surface->w / 2.0;
-	buf->cam_y = (double) buf->doc.surface->h / 2.0;
+	buf->cam_x = (double) buf->doc.font->w / 2.0;
+	buf->cam_y = (double) buf->doc.font->h / 2.0;
 	buf->cam_z = 1.0;
 
 	buf->select = NULL;
@@ -661,84 +1607,57 @@ void cleanup_buffers ()
 
 void render_block (struct doc doc, int col, int row)
 {
-	SDL_Surface *block = doc.surface;
-	block->pixels = doc.pixels[col + (row / 2) * doc.cols];
-	SDL_Rect block_rect = {col * doc.font->w,
-	                       row * doc.font->h / 2,
-	                       doc.font->w,
-	                       doc.font->h};
-	SDL_Texture *block_texture = SDL_CreateTextureFromSurface(renderer,
-	                                                          block);
-	SDL_SetTextureBlendMode(block_texture, 0);
-	SDL_SetRenderTarget(renderer, doc.texture);
-	SDL_SetRenderDrawColor(renderer,
-	                       TRANSPARENT_R,
-	                       TRANSPARENT_G,
-	                       TRANSPARENT_B,
-	                       TRANSPARENT_A);
-	SDL_RenderFillRect(renderer, &block_rect);
-	SDL_RenderCopy(renderer, block_texture, NULL, &block_rect);
-	SDL_SetRenderTarget(renderer, NULL);
-	SDL_DestroyTexture(block_texture);
-}
-
-void blit_cmy (SDL_Surface *dest, unsigned char *src, struct cmy cmy, int w, int h, int offset)
-{
-	int at_y = 0;
-
-	if (offset < 0) {
-		src -= w * offset;
-		h += offset;
-	} else if (offset > 0) {
-		at_y = offset;
-		h -= offset;
-	}
-
-	int pitch = dest->pitch;
-	Uint8 *p;
-	Uint8 r, g, b;
-
-	for (int y = at_y; y < at_y + h; y++) {
-		p = dest->pixels + y * pitch;
-		for (int x = 0; x < w; x++) {
-			if (*src) {
-				SDL_GetRGB(*((Uint32 *)p),
-				           dest->format,
-				           &r, &g, &b);
-				if (r > cmy.c) r -= cmy.c;
-				else           r  = 0;
-				if (g > cmy.m) g -= cmy.m;
-				else           g  = 0;
-				if (b > cmy.y) b -= cmy.y;
-				else           b  = 0;
-				*((Uint32 *) p) = SDL_MapRGBA(dest->format,
-				                              r, g, b, 0xff);
-			}
-			src++;
-			p += BYTES_PER_PIXEL;
-		}
-	}
+	struct upload *upload = doc.upload;
+
+	if (!mark_block(upload->dirty[upload->back], col, row / 2))
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Block may be stale on screen.\n");
+	if (doc.num_lods)
+		mark_lod(doc, 1, col / 2, row / 4);
 }
 
 void blit_to_block (struct doc doc, int col, int row, int offset,
                     unsigned char color, unsigned char glyph)
 {
-	SDL_Surface *block = doc.surface;
-	block->pixels = doc.pixels[col + (row / 2) * doc.cols];
-	blit_cmy(block,
-	         doc.font->glyph[glyph],
-	         doc.palette->cmy[color],
-	         doc.font->w,
-	         doc.font->h,
-	         offset);
+	Uint8 *pixels = touch_block(doc, col, row);
+
+	if (!pixels) {
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Could not draw stroke.\n");
+		return;
+	}
+
+	blit_glyph(pixels,
+	           doc.pitch,
+	           doc.font->h,
+	           font_glyph(doc.font, glyph),
+	           cmy_to_sub(doc.palette->cmy[color]),
+	           offset);
+}
+
+// Leave the block at an even row for commit_batch to redraw.
+void batch_block (struct doc doc, int col, int row)
+{
+	// With no memory to put it off, the block is drawn now.
+	if (!mark_block(doc.batch->stale, col, row / 2)) {
+		draw_block(doc, col, row);
+		if (doc.upload)
+			render_block(doc, col, row);
+	}
 }
 
 void draw_stroke (struct doc doc, int col, int row,
                   unsigned char color, unsigned char glyph)
 {
-	SDL_Surface *dest = doc.surface;
-	SDL_Texture *dest_texture;
-	SDL_Rect dest_rect = {0, 0, doc.font->w, doc.font->h};
+	if (doc.batch->depth) {
+		if (row & 1) {
+			batch_block(doc, col, row - 1);
+			batch_block(doc, col, row + 1);
+		} else batch_block(doc, col, row);
+		return;
+	}
 
 	if (row & 1) {
 		blit_to_block(doc,
@@ -753,13 +1672,13 @@ void draw_stroke (struct doc doc, int col, int row,
 		              -(doc.font->h / 2),
 		              color,
 		              glyph);
-		if (doc.texture) {
+		if (doc.upload) {
 			render_block(doc, col, row - 1);
 			render_block(doc, col, row + 1);
 		}
 	} else {
 		blit_to_block(doc, col, row, 0, color, glyph);
-		if (doc.texture)
+		if (doc.upload)
 			render_block(doc, col, row);
 	}
 }
@@ -773,62 +1692,181 @@ void draw_all_strokes (struct doc doc, int col, int doc_row, int block_row)
 		offset = -(doc.font->h / 2);
 	}
 
-	for (struct stroke *stroke = doc.stroke[col + doc_row * doc.cols];
-	     stroke;
-	     stroke = stroke->next) {
+	struct cell *cell = doc_cell(doc, col, doc_row);
+	struct stroke *stroke = cell_strokes(doc, cell);
+
+	for (Uint32 i = 0; i < cell->len; i++) {
 		blit_to_block(doc,
 		              col,
 		              block_row,
 		              offset,
-		              stroke->color,
-		              stroke->glyph);
+		              stroke[i].color,
+		              stroke[i].glyph);
 	}
 }
 
-void draw_pos (struct doc doc, int col, int row)
+// Redraw the block at an even row from the strokes of the rows it shows.
+void draw_block (struct doc doc, int col, int row)
 {
-	SDL_Surface *block = doc.surface;
+	Uint8 *pixels;
+
+	// A block no stroke reaches any more goes back to doc.blank.
+	if (!(row < doc.rows && doc_cell(doc, col, row)->len) &&
+	    !(row > 0 && doc_cell(doc, col, row - 1)->len) &&
+	    !(row < doc.rows - 1 && doc_cell(doc, col, row + 1)->len)) {
+		release_block(doc, col, row);
+		return;
+	}
 
+	pixels = block_pixels(doc, col, row);
+	if (pixels != doc.blank)
+		fill_pixels(pixels, doc.font->h * doc.pitch, TRANSPARENT_RGBA);
+
+	if (row < doc.rows)
+		draw_all_strokes(doc, col, row, row);
+	if (row > 0)
+		draw_all_strokes(doc, col, row - 1, row);
+	if (row < doc.rows - 1)
+		draw_all_strokes(doc, col, row + 1, row);
+}
+
+void draw_pos (struct doc doc, int col, int row)
+{
 	if (row & 1) {
 		draw_pos(doc, col, row - 1);
 		draw_pos(doc, col, row + 1);
+	} else if (doc.batch->depth) {
+		batch_block(doc, col, row);
 	} else {
-		block->pixels = doc.pixels[col + (row / 2) * doc.cols];
-		SDL_FillRect(block, NULL, TRANSPARENT_RGBA);
-		draw_all_strokes(doc, col, row, row);
-		if (row > 0)
-			draw_all_strokes(doc, col, row - 1, row);
-		if (row < doc.rows - 1)
-			draw_all_strokes(doc, col, row + 1, row);
-		if (doc.texture)
+		draw_block(doc, col, row);
+		if (doc.upload)
 			render_block(doc, col, row);
 	}
 }
 
+// Inside a batch strokes only go into the cells; rasterizing waits for
+// the outermost commit. Batches nest.
+void begin_batch (struct doc doc)
+{
+	if (doc.batch)
+		doc.batch->depth++;
+}
+
+// The blocks of one stale tile per job. A job only allocates in its own
+// tile; the tiles were made before any job started.
+void redraw_tile (void *arg, int i)
+{
+	struct doc *doc = arg;
+	struct marked *tile = doc->batch->stale->tile + i;
+	int b;
+
+	for (int k = 0; k < TILE_BLOCKS / 64; k++) {
+		for (Uint64 bits = tile->bits[k]; bits; bits &= bits - 1) {
+			b = k * 64 + __builtin_ctzll(bits);
+			draw_block(*doc, marked_col(tile, b), 2 * marked_row(tile, b));
+		}
+	}
+}
+
+// Blocks are redrawn in parallel, each once however many strokes landed
+// on it, one job per tile that has any. Marking them for upload stays on
+// this thread.
+void commit_batch (struct doc doc)
+{
+	struct batch *batch = doc.batch;
+	struct marks *stale;
+	struct marked *tile;
+	int b;
+
+	if (!batch || --batch->depth > 0 || !batch->stale->len)
+		return;
+	stale = batch->stale;
+
+	for (int i = 0; i < stale->len; i++) {
+		tile = stale->tile + i;
+		if (!doc_tile(doc, tile->x * TILE_COLS, tile->y * TILE_ROWS, 1)) {
+			fprintf(stderr,
+			        "Error allocating memory.\n"
+			        "Could not redraw document.\n");
+			clear_marks(stale);
+			return;
+		}
+	}
+
+	pool_run(stale->len, redraw_tile, &doc);
+
+	for (int i = 0; doc.upload && i < stale->len; i++) {
+		tile = stale->tile + i;
+		for (int k = 0; k < TILE_BLOCKS / 64; k++) {
+			for (Uint64 bits = tile->bits[k]; bits; bits &= bits - 1) {
+				b = k * 64 + __builtin_ctzll(bits);
+				render_block(doc,
+				             marked_col(tile, b),
+				             2 * marked_row(tile, b));
+			}
+		}
+	}
+	clear_marks(stale);
+}
+
+// Redraw every block that can show ink: the blocks of tiles with cells
+// or pixels, and below a tile with cells the blocks showing the lower
+// half of an inked cell in its last row. The rest of the sheet was never
+// drawn on. The blocks go through a batch, so the redraw is spread over
+// the pool.
 void draw_doc (struct doc doc)
 {
-	for (int row = 0; row < doc.rows; row += 2) {
-		for (int col = 0; col < doc.cols; col++) {
-			draw_pos(doc, col, row);
+	int num_block_rows = (doc.rows + 2) / 2;
+	int last_row;
+	struct tile *tile;
+	int end_row;
+	int end_col;
+
+	begin_batch(doc);
+	for (int y = 0; y < doc.tiles_y; y++) {
+		for (int x = 0; doc.tile[y] && x < doc.tiles_x; x++) {
+			tile = doc.tile[y][x];
+			if (!tile || (!tile->cell && !tile->block))
+				continue;
+			end_row = (y + 1) * (TILE_ROWS / 2);
+			if (end_row > num_block_rows)
+				end_row = num_block_rows;
+			end_col = (x + 1) * TILE_COLS;
+			if (end_col > doc.cols)
+				end_col = doc.cols;
+			for (int block_row = y * (TILE_ROWS / 2);
+			     block_row < end_row;
+			     block_row++) {
+				for (int col = x * TILE_COLS; col < end_col; col++)
+					draw_pos(doc, col, block_row * 2);
+			}
+			last_row = (y + 1) * TILE_ROWS - 1;
+			for (int col = x * TILE_COLS;
+			     tile->cell && end_row < num_block_rows && col < end_col;
+			     col++) {
+				if (doc_cell(doc, col, last_row)->len)
+					draw_pos(doc, col, last_row + 1);
+			}
 		}
 	}
+	commit_batch(doc);
 }
 
 int raise_stroke (struct doc doc, int col, int row, unsigned char color, unsigned char glyph)
 {
-	struct stroke *prev = NULL;
-
-	for (struct stroke *stroke = doc.stroke[col + row * doc.cols];
-	     stroke;
-	     stroke = stroke->next) {
-		if (stroke->color == color && stroke->glyph == glyph) {
-			if (!prev) return 1;
-			prev->next = stroke->next;
-			stroke->next = doc.stroke[col + row * doc.cols];
-			doc.stroke[col + row * doc.cols] = stroke;
+	struct cell *cell = doc_cell(doc, col, row);
+	struct stroke *stroke = cell_strokes(doc, cell);
+	struct stroke found;
+
+	for (Uint32 i = cell->len; i-- > 0;) {
+		if (stroke[i].color == color && stroke[i].glyph == glyph) {
+			found = stroke[i];
+			memmove(stroke + i,
+			        stroke + i + 1,
+			        (cell->len - i - 1) * sizeof(struct stroke));
+			stroke[cell->len - 1] = found;
 			return 1;
 		}
-		prev = stroke;
 	}
 
 	return 0;
@@ -840,151 +1878,440 @@ struct stroke *add_stroke (struct doc doc, int col, int row,
 	if (col < 0 || row < 0 || col >= doc.cols || row >= doc.rows)
 		return NULL;
 
-	if (!doc.font->glyph[glyph])
+	if (!font_glyph(doc.font, glyph))
 		return NULL;
 
-	if (raise_stroke(doc, col, row, color, glyph))
-		return doc.stroke[col + row * doc.cols];
+	struct cell *cell = touch_cell(doc, col, row);
+
+	if (cell && raise_stroke(doc, col, row, color, glyph))
+		return cell_strokes(doc, cell) + cell->len - 1;
 
-	struct stroke *stroke = malloc(sizeof(struct stroke));
+	struct stroke stroke = {color, glyph};
 
-	if (!stroke) {
+	if (!cell || !cell_push(doc, cell, stroke)) {
 		fprintf(stderr,
 		        "Error allocating memory.\n"
 		        "Could not add stroke.\n");
 		return NULL;
 	}
 
-	stroke->color = color;
-	stroke->glyph = glyph;
-	stroke->next = doc.stroke[col + row * doc.cols];
-	doc.stroke[col + row * doc.cols] = stroke;
 	draw_stroke(doc, col, row, color, glyph);
 
-	return stroke;
+	return cell_strokes(doc, cell) + cell->len - 1;
 }
 
 struct stroke *del_stroke (struct doc doc, int col, int row)
 {
-	struct stroke *stroke = doc.stroke[col + row * doc.cols];
+	struct cell *cell = doc_cell(doc, col, row);
 
-	if (!stroke) return NULL;
+	if (!cell->len) return NULL;
 
-	doc.stroke[col + row * doc.cols] = stroke->next;
-	free(stroke);
+	cell_pop(doc, cell);
 	draw_pos(doc, col, row);
 
-	return doc.stroke[col + row * doc.cols];
+	if (!cell->len) return NULL;
+
+	return cell_strokes(doc, cell) + cell->len - 1;
 }
 
-int save_buffer (struct buffer *buf, FILE *f)
+// Version 1 documents are little endian:
+//
+//	"SYN" 1, cols u16, rows u16, band rows u16,
+//	colors u8, then c, m, y for each color,
+//	font w u16, font h u16, font hash u64,
+//	bands u32, then bands + 1 offsets u64 into the band data,
+//	band data.
+//
+// A band holds whole rows. It is a list of cells that have strokes, each
+// given as a varint count of empty cells skipped before it, a varint
+// stroke count, then color and glyph for each stroke, bottom first.
+static Uint64 get_le (unsigned char *p, int n)
 {
-	Uint16 doc_cols = buf->doc.cols;
-	Uint16 doc_rows = buf->doc.rows;
-	unsigned char color;
-	unsigned char glyph;
-
-	fwrite("SYN", 1, 3, f);
-	fwrite("\0", 1, 1, f);
-	fwrite(&doc_cols, sizeof(Uint16), 1, f);
-	fwrite(&doc_rows, sizeof(Uint16), 1, f);
-
-	for (int row = 0; row < buf->doc.rows; row++) {
-		for (int col = 0; col < buf->doc.cols; col++) {
-			for (struct stroke *stroke = buf->doc.stroke[col +
-			                                             row *
-			                                             buf->doc.cols];
-			     stroke;
-			     stroke = stroke->next) {
-				glyph = stroke->glyph;
-				color = stroke->color;
-				fwrite(&glyph, 1, 1, f);
-				fwrite(&color, 1, 1, f);
-			}
-			fwrite("\0", 1, 1, f);
+	Uint64 v = 0;
+
+	while (n--)
+		v = v << 8 | p[n];
+
+	return v;
+}
+
+static unsigned char *put_le (unsigned char *p, Uint64 v, int n)
+{
+	for (int i = 0; i < n; i++, v >>= 8)
+		*p++ = v & 0xff;
+
+	return p;
+}
+
+static unsigned char *put_varint (unsigned char *p, Uint32 v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+
+	return p;
+}
+
+static unsigned char *get_varint (unsigned char *p, unsigned char *end, Uint32 *v_p)
+{
+	Uint32 v = 0;
+
+	for (int shift = 0; p < end && shift < 35; shift += 7) {
+		v |= (Uint32) (*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			*v_p = v;
+			return p;
 		}
 	}
 
-	return 1;
+	return NULL;
 }
 
-struct buffer *load_buffer (FILE *f)
+struct bands {
+	struct doc doc;
+	int band_rows;
+	int num_bands;
+	unsigned char **data;
+	size_t *len;
+	unsigned char *src;
+	Uint64 *offset;
+	char *spilled;
+	char serial;
+	atomic_int failed;
+};
+
+// Tiles without cells, and tile rows without tiles, are skipped whole.
+void save_band (void *arg, int band)
 {
-	unsigned char magic_num[4] = {0, 0, 0, 0};
-	unsigned char version;
-	Uint16 doc_cols = 0;
-	Uint16 doc_rows = 0;
+	struct bands *bands = arg;
+	struct doc doc = bands->doc;
+	int row = band * bands->band_rows;
+	int end_row = row + bands->band_rows;
+	size_t size = SYN_BAND_SIZE;
+	size_t len = 0;
+	struct tile *tile;
+	struct cell *cell;
+	struct stroke *stroke;
+	unsigned char *data = malloc(size);
+	unsigned char *p;
+	Uint32 skip = 0;
+	int n;
+
+	if (end_row > doc.rows)
+		end_row = doc.rows;
+
+	for (; data && row < end_row; row++) {
+		if (!doc.tile[row / TILE_ROWS]) {
+			n = (row / TILE_ROWS + 1) * TILE_ROWS;
+			n = (n < end_row ? n : end_row) - row;
+			skip += n * doc.cols;
+			row += n - 1;
+			continue;
+		}
+		for (int col = 0; col < doc.cols; col += TILE_COLS) {
+			tile = doc_tile(doc, col, row, 0);
+			n = doc.cols - col < TILE_COLS ? doc.cols - col : TILE_COLS;
+			if (!tile || !tile->cell) {
+				skip += n;
+				continue;
+			}
+			cell = doc_cell(doc, col, row);
+			for (int i = 0; i < n; i++, cell++) {
+				if (!cell->len) {
+					skip++;
+					continue;
+				}
+				while (size - len < 10 + 2 * cell->len) {
+					size *= 2;
+					p = realloc(data, size);
+					if (!p) {
+						free(data);
+						atomic_store(&bands->failed, 1);
+						return;
+					}
+					data = p;
+				}
+				p = data + len;
+				p = put_varint(p, skip);
+				p = put_varint(p, cell->len);
+				stroke = cell_strokes(doc, cell);
+				for (Uint32 k = 0; k < cell->len; k++) {
+					*p++ = stroke[k].color;
+					*p++ = stroke[k].glyph;
+				}
+				len = p - data;
+				skip = 0;
+			}
+		}
+	}
 
-	fread(magic_num, 1, 3, f);
+	if (!data)
+		atomic_store(&bands->failed, 1);
+	bands->data[band] = data;
+	bands->len[band] = len;
+}
 
-	if (strcmp(magic_num, "SYN")) {
+int save_buffer (struct buffer *buf, FILE *f)
+{
+	struct doc doc = buf->doc;
+	struct bands bands = {0};
+	unsigned char *head;
+	unsigned char *p;
+	size_t head_len;
+	Uint64 at = 0;
+	int ok = 0;
+
+	bands.doc = doc;
+	bands.band_rows = SYN_BAND_ROWS;
+	bands.num_bands = (doc.rows + SYN_BAND_ROWS - 1) / SYN_BAND_ROWS;
+	bands.data = calloc(bands.num_bands, sizeof(unsigned char *));
+	bands.len = calloc(bands.num_bands, sizeof(size_t));
+	head_len = 11 + 3 * doc.palette->num_colors + 16 + 8 * (bands.num_bands + 1);
+	head = malloc(head_len);
+
+	if (!bands.data || !bands.len || !head) {
 		fprintf(stderr,
-		        "File is not a valid Synthotype document.\n"
-			"Could not load document.\n");
-		return NULL;
+		        "Error allocating memory.\n"
+		        "Could not save document.\n");
+		goto done;
 	}
 
-	fread(&version, 1, 1, f);
+	atomic_init(&bands.failed, 0);
+	pool_run(bands.num_bands, save_band, &bands);
+	if (atomic_load(&bands.failed)) {
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Could not save document.\n");
+		goto done;
+	}
 
-	struct buffer *buf = NULL;
-	int row = 0;
-	int col = 0;
-	unsigned char color;
-	unsigned char glyph;
+	p = head;
+	memcpy(p, "SYN\1", 4);
+	p = put_le(p + 4, doc.cols, 2);
+	p = put_le(p, doc.rows, 2);
+	p = put_le(p, SYN_BAND_ROWS, 2);
+	*p++ = doc.palette->num_colors;
+	for (int i = 0; i < doc.palette->num_colors; i++) {
+		*p++ = doc.palette->cmy[i].c;
+		*p++ = doc.palette->cmy[i].m;
+		*p++ = doc.palette->cmy[i].y;
+	}
+	p = put_le(p, doc.font->w, 2);
+	p = put_le(p, doc.font->h, 2);
+	p = put_le(p, doc.font->hash, 8);
+	p = put_le(p, bands.num_bands, 4);
+	for (int band = 0; band <= bands.num_bands; band++) {
+		p = put_le(p, at, 8);
+		if (band < bands.num_bands)
+			at += bands.len[band];
+	}
 
-	switch (version) {
-		case 0:
-			fread(&doc_cols, sizeof(Uint16), 1, f);
-			fread(&doc_rows, sizeof(Uint16), 1, f);
+	ok = fwrite(head, 1, head_len, f) == head_len;
+	for (int band = 0; ok && band < bands.num_bands; band++)
+		ok = fwrite(bands.data[band], 1, bands.len[band], f) == bands.len[band];
 
-			if (doc_cols < 1 || doc_rows < 1) {
-				fprintf(stderr,
-				        "Invalid document size encountered.\n"
-				        "Could not load document.\n");
-				return NULL;
+	if (!ok)
+		fprintf(stderr,
+		        "Error writing file.\n"
+		        "Could not save document.\n");
+
+done:
+	for (int band = 0; bands.data && band < bands.num_bands; band++)
+		free(bands.data[band]);
+	free(bands.data);
+	free(bands.len);
+	free(head);
+
+	return ok;
+}
+
+// Put a stroke into its cell without drawing it, as add_stroke would.
+int load_stroke (struct doc doc, Uint64 at, unsigned char color, unsigned char glyph)
+{
+	int col = at % doc.cols;
+	int row = at / doc.cols;
+	struct stroke stroke = {color, glyph};
+
+	if (color >= doc.palette->num_colors || !font_glyph(doc.font, glyph))
+		return 1;
+	if (raise_stroke(doc, col, row, color, glyph))
+		return 1;
+
+	struct cell *cell = touch_cell(doc, col, row);
+
+	return cell && cell_push(doc, cell, stroke);
+}
+
+// Walk the records of a band. The parallel pass fills the cells that fit
+// in line. Longer stacks need the shared spill pool, so they are left for
+// a serial pass over the bands that have them.
+void load_band (void *arg, int band)
+{
+	struct bands *bands = arg;
+	struct doc doc = bands->doc;
+	unsigned char *p = bands->src + bands->offset[band];
+	unsigned char *end = bands->src + bands->offset[band + 1];
+	Uint64 at = (Uint64) band * bands->band_rows * doc.cols;
+	Uint64 last = (Uint64) (band + 1) * bands->band_rows * doc.cols;
+	Uint32 skip;
+	Uint32 n;
+
+	if (last > (Uint64) doc.rows * doc.cols)
+		last = (Uint64) doc.rows * doc.cols;
+
+	while (p < end) {
+		if (!(p = get_varint(p, end, &skip)) ||
+		    !(p = get_varint(p, end, &n)) ||
+		    (end - p) / 2 < n ||
+		    skip >= last - at) {
+			atomic_store(&bands->failed, 1);
+			return;
+		}
+		at += skip;
+		if (n > CELL_INLINE)
+			bands->spilled[band] = 1;
+		if ((n > CELL_INLINE) == bands->serial) {
+			for (Uint32 i = 0; i < n; i++) {
+				if (!load_stroke(doc, at, p[2 * i], p[2 * i + 1])) {
+					atomic_store(&bands->failed, 1);
+					return;
+				}
 			}
+		}
+		p += 2 * n;
+		at++;
+	}
+}
 
-			if (curbuf) {
-				buf = new_buffer(copy_font(curbuf->doc.font),
-				                 copy_palette(curbuf->doc.palette),
-				                 doc_cols,
-				                 doc_rows);
-			} else if (allbuf) {
-				buf = new_buffer(copy_font(allbuf->doc.font),
-				                 copy_palette(allbuf->doc.palette),
-				                 doc_cols,
-				                 doc_rows);
-			} else {
-				buf = new_buffer(load_font(INIT_FONT),
-				                 default_palette(),
-				                 doc_cols,
-				                 doc_rows);
+// Version 0 cells are glyph and color pairs ended by a zero glyph. Colors
+// may be zero too, so cell ends are only found by stepping over pairs.
+void load_band_v0 (void *arg, int band)
+{
+	struct bands *bands = arg;
+	struct doc doc = bands->doc;
+	unsigned char *p = bands->src + bands->offset[band];
+	unsigned char *end = bands->src + bands->offset[band + 1];
+	unsigned char *q;
+	Uint64 at = (Uint64) band * bands->band_rows * doc.cols;
+	Uint32 n;
+
+	for (; p < end; p = q + (q < end), at++) {
+		for (q = p; q + 1 < end && *q; q += 2);
+		n = (q - p) / 2;
+		if (n > CELL_INLINE)
+			bands->spilled[band] = 1;
+		if ((n > CELL_INLINE) != bands->serial)
+			continue;
+		for (Uint32 i = 0; i < n; i++) {
+			if (!load_stroke(doc, at, p[2 * i + 1], p[2 * i])) {
+				atomic_store(&bands->failed, 1);
+				return;
 			}
+		}
+	}
+}
+
+// Index the bands of a version 0 document in one pass over the cell ends.
+void index_bands_v0 (struct bands *bands, unsigned char *end)
+{
+	unsigned char *p = bands->src;
+	Uint64 band_cells = (Uint64) bands->band_rows * bands->doc.cols;
+	Uint64 cells = (Uint64) bands->doc.rows * bands->doc.cols;
+	Uint64 at;
+
+	for (at = 0; at < cells && p < end; at++) {
+		if (at % band_cells == 0)
+			bands->offset[at / band_cells] = p - bands->src;
+		while (p + 1 < end && *p)
+			p += 2;
+		p += p < end;
+	}
+
+	for (int band = (at + band_cells - 1) / band_cells;
+	     band <= bands->num_bands;
+	     band++)
+		bands->offset[band] = p - bands->src;
+}
+
+// New documents take the font, and unless given one the palette, of the
+// buffer in use, of any buffer, or else the defaults.
+struct buffer *new_load_buffer (int cols, int rows, struct palette *palette)
+{
+	struct buffer *like = curbuf ? curbuf : allbuf;
+
+	if (like) {
+		return new_buffer(copy_font(like->doc.font),
+		                  palette ? palette : copy_palette(like->doc.palette),
+		                  cols,
+		                  rows);
+	}
+
+	return new_buffer(load_font(INIT_FONT),
+	                  palette ? palette : default_palette(),
+	                  cols,
+	                  rows);
+}
+
+// Build a buffer from a whole document in memory. Bands are decoded in
+// parallel straight out of src, each into its own rows of cells, and the
+// strokes are rasterized once at the end.
+struct buffer *load_memory (unsigned char *src, size_t len)
+{
+	void (*decode) (void *arg, int band) = load_band;
+	unsigned char *p = src + 4;
+	unsigned char *end = src + len;
+	struct bands bands = {0};
+	struct palette *palette = NULL;
+	struct buffer *buf = NULL;
+	int cols, rows, num_colors, num_bands;
+	int font_w = 0, font_h = 0;
+	Uint64 font_hash = 0;
+
+	if (len < 4 || memcmp(src, "SYN", 3)) {
+		fprintf(stderr,
+		        "File is not a valid Synthotype document.\n"
+		        "Could not load document.\n");
+		return NULL;
+	}
 
-			if (!buf) {
+	switch (src[3]) {
+		case 0:
+			if (end - p < 4)
+				goto corrupt;
+			cols = get_le(p, 2);
+			rows = get_le(p + 2, 2);
+			p += 4;
+			bands.band_rows = SYN_BAND_ROWS;
+			decode = load_band_v0;
+			break;
+		case 1:
+			if (end - p < 7)
+				goto corrupt;
+			cols = get_le(p, 2);
+			rows = get_le(p + 2, 2);
+			bands.band_rows = get_le(p + 4, 2);
+			num_colors = p[6];
+			p += 7;
+			if (!num_colors || end - p < 3 * num_colors + 16)
+				goto corrupt;
+			palette = new_palette(num_colors);
+			if (!palette) {
 				fprintf(stderr,
 				        "Could not load document.\n");
 				return NULL;
 			}
-
-			while (!feof(f) && row <= buf->doc.rows) {
-				glyph = fgetc(f);
-				while (glyph && !feof(f)) {
-					color = fgetc(f);
-					add_stroke(buf->doc,
-					           col,
-					           row,
-					           color,
-					           glyph);
-					glyph = fgetc(f);
-				}
-				col++;
-				if (col >= buf->doc.cols) {
-					col = 0;
-					row++;
-				}
+			for (int i = 0; i < num_colors; i++, p += 3) {
+				palette->cmy[i].c = p[0];
+				palette->cmy[i].m = p[1];
+				palette->cmy[i].y = p[2];
 			}
-
+			font_w = get_le(p, 2);
+			font_h = get_le(p + 2, 2);
+			font_hash = get_le(p + 4, 8);
+			bands.num_bands = get_le(p + 12, 4);
+			p += 16;
 			break;
 		default:
 			fprintf(stderr,
@@ -993,6 +2320,164 @@ struct buffer *load_buffer (FILE *f)
 			return NULL;
 	}
 
+	if (cols < 1 || rows < 1 || bands.band_rows < 1) {
+		fprintf(stderr,
+		        "Invalid document size encountered.\n"
+		        "Could not load document.\n");
+		destroy_palette(&palette);
+		return NULL;
+	}
+
+	num_bands = (rows + bands.band_rows - 1) / bands.band_rows;
+	if (src[3] && bands.num_bands != num_bands)
+		goto corrupt;
+	bands.num_bands = num_bands;
+	bands.offset = malloc((num_bands + 1) * sizeof(Uint64));
+	bands.spilled = calloc(num_bands, 1);
+	if (!bands.offset || !bands.spilled) {
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Could not load document.\n");
+		goto fail;
+	}
+
+	if (src[3]) {
+		if ((end - p) / 8 < num_bands + 1)
+			goto corrupt;
+		for (int band = 0; band <= num_bands; band++, p += 8) {
+			bands.offset[band] = get_le(p, 8);
+			if (band ? bands.offset[band] < bands.offset[band - 1] :
+			           bands.offset[band] != 0)
+				goto corrupt;
+		}
+		if (end < p || bands.offset[num_bands] > (Uint64) (end - p))
+			goto corrupt;
+	}
+	bands.src = p;
+
+	buf = new_load_buffer(cols, rows, palette);
+	destroy_palette(&palette);
+	if (!buf) {
+		fprintf(stderr,
+		        "Could not load document.\n");
+		goto fail;
+	}
+
+	if (src[3] && (font_w != buf->doc.font->w ||
+	               font_h != buf->doc.font->h ||
+	               font_hash != buf->doc.font->hash))
+		fprintf(stderr,
+		        "Document was written with a different font.\n"
+		        "It is shown with the current one.\n");
+
+	bands.doc = buf->doc;
+	if (!src[3])
+		index_bands_v0(&bands, end);
+	atomic_init(&bands.failed, 0);
+	// Bands sharing a tile would race to allocate it.
+	if (bands.band_rows % TILE_ROWS) {
+		for (int band = 0; band < num_bands; band++)
+			decode(&bands, band);
+	} else pool_run(num_bands, decode, &bands);
+	bands.serial = 1;
+	for (int band = 0; band < num_bands; band++) {
+		if (bands.spilled[band])
+			decode(&bands, band);
+	}
+	if (atomic_load(&bands.failed))
+		goto corrupt;
+
+	draw_doc(buf->doc);
+
+	free(bands.offset);
+	free(bands.spilled);
+
+	return buf;
+
+corrupt:
+	fprintf(stderr,
+	        "Document is damaged or cut short.\n"
+	        "Could not load document.\n");
+fail:
+	free(bands.offset);
+	free(bands.spilled);
+	destroy_palette(&palette);
+	destroy_buffer(&buf);
+	return NULL;
+}
+
+struct buffer *load_buffer (FILE *f)
+{
+	size_t size = SYN_READ_SIZE;
+	size_t len = 0;
+	size_t n;
+	unsigned char *src = malloc(size);
+	unsigned char *grow;
+	struct buffer *buf;
+
+	while (src && (n = fread(src + len, 1, size - len, f))) {
+		len += n;
+		if (len < size)
+			continue;
+		size *= 2;
+		grow = realloc(src, size);
+		if (!grow)
+			free(src);
+		src = grow;
+	}
+
+	if (!src) {
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Could not load document.\n");
+		return NULL;
+	}
+
+	buf = load_memory(src, len);
+	free(src);
+
+	return buf;
+}
+
+// Map the document rather than read it, so the workers decoding each
+// band fault in their own part of the file.
+struct buffer *load_file (unsigned char *path)
+{
+	struct buffer *buf;
+	struct stat st;
+	void *map;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr,
+		        "Error opening file '%s'.\n"
+		        "Could not load document.\n",
+		        path);
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	if (!st.st_size) {
+		close(fd);
+		return load_memory("", 0);
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		fprintf(stderr,
+		        "Error mapping file '%s'.\n"
+		        "Could not load document.\n",
+		        path);
+		return NULL;
+	}
+
+	madvise(map, st.st_size, MADV_WILLNEED);
+	buf = load_memory(map, st.st_size);
+	munmap(map, st.st_size);
+
 	return buf;
 }
 
@@ -1059,21 +2544,53 @@ void copy_selection (struct buffer *buf)
 	                    w,
 	                    h);
 
-	struct stroke *new_stroke;
+	struct cell *cell;
+	struct stroke *stroke;
 
+	begin_batch(clipboard);
 	for (int row = lo_row; row <= hi_row; row++) {
 		for (int col = lo_col; col <= hi_col; col++) {
-			for (struct stroke *stroke = buf->doc.stroke[col + row * buf->doc.cols];
-			     stroke;
-			     stroke = stroke->next) {
+			cell = doc_cell(buf->doc, col, row);
+			stroke = cell_strokes(buf->doc, cell);
+			for (Uint32 i = cell->len; i-- > 0;) {
 				add_stroke(clipboard,
 				           col - lo_col,
 				           row - lo_row,
-				           stroke->color,
-				           stroke->glyph);
+				           stroke[i].color,
+				           stroke[i].glyph);
 			}
 		}
 	}
+	commit_batch(clipboard);
+}
+
+// Remove every stroke in the rectangle, then redraw each block it
+// touches once.
+void clear_rect (struct doc doc, int col, int row, int cols, int rows)
+{
+	struct cell *cell;
+	int end_col = col + cols;
+	int end_row = row + rows;
+
+	if (col < 0) col = 0;
+	if (row < 0) row = 0;
+	if (end_col > doc.cols) end_col = doc.cols;
+	if (end_row > doc.rows) end_row = doc.rows;
+	if (col >= end_col || row >= end_row)
+		return;
+
+	for (int r = row; r < end_row; r++) {
+		for (int c = col; c < end_col; c++) {
+			cell = doc_cell(doc, c, r);
+			while (cell->len)
+				cell_pop(doc, cell);
+		}
+	}
+
+	for (int r = row & ~1; r <= end_row; r += 2) {
+		for (int c = col; c < end_col; c++)
+			draw_pos(doc, c, r);
+	}
 }
 
 void clear_selection (struct buffer *buf)
@@ -1090,17 +2607,22 @@ void clear_selection (struct buffer *buf)
 
 void paste_doc (struct doc dest, struct doc src, int at_col, int at_row)
 {
+	struct cell *cell;
+	struct stroke *stroke;
+
+	begin_batch(dest);
 	for (int row = 0; row < src.rows; row++) {
 		for (int col = 0; col < src.cols; col++) {
-			for (struct stroke *stroke = src.stroke[col + row * src.cols];
-			     stroke;
-			     stroke = stroke->next) {
+			cell = doc_cell(src, col, row);
+			stroke = cell_strokes(src, cell);
+			for (Uint32 i = cell->len; i-- > 0;) {
 				add_stroke(dest,
 				           at_col + col,
 				           at_row + row,
-				           stroke->color,
-				           stroke->glyph);
+				           stroke[i].color,
+				           stroke[i].glyph);
 			}
 		}
 	}
+	commit_batch(dest);
 }
@@ -10,15 +10,26 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <ctype.h>
 #include <math.h>
 #include "type.h"
 
+#include <poll.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+#include "type_shm.h"
+
 #define CHBUF_INIT_SIZE 32
-#define CHBUF_CHUNK_SIZE 16
+#define CMDQ_INIT_SIZE 32
+#define CTRL_READ_SIZE (1 << 16)
+#define CSI_MAX 256
 
-#define lock(chbuf) while (chbuf->lock); chbuf->lock = 1;
-#define unlock(chbuf) chbuf->lock = 0;
+#define RING_DEFAULT_SIZE (1 << 16)
+#define RING_MIN_SIZE 64
+#define RING_DRAIN_PASSES 16
+#define SHM_DEFAULT_SIZE (1 << 22)
 
 #define MAX_KEYCODE 400
 #define HIGH_KEY 1073741824
@@ -33,33 +44,48 @@
 
 #define CLIP_ON 32
 
-#define lokey(key) (key < HIGH_KEY ? key : key - HIGH_KEY_DELTA)
+#define chbuf_at(chbuf, i) ((i) < (chbuf)->len ? (chbuf)->ch[i] : 0)
 
-struct chbuf {
-	char lock;
-	size_t size;
-	size_t len;
-	unsigned char *ch;
-};
+#define lokey(key) (key < HIGH_KEY ? key : key - HIGH_KEY_DELTA)
 
 struct binding {
 	unsigned force_mode;
 	unsigned block_mode;
-	unsigned char *str;
+	size_t num_cmds;
+	struct command *cmd;
 	struct binding *next;
 };
 
 unsigned mode = 0;
-struct binding *keybind[MAX_KEYCODE] = {0};
+struct binding *keybind[MAX_KEYCODE + 1] = {0};
 unsigned char *fifo_in = "/tmp/synthotype-in";
 unsigned char *fifo_out = "/tmp/synthotype-out";
-struct chbuf *stream;
-struct chbuf *return_stream;
+size_t ring_size = RING_DEFAULT_SIZE;
+struct ring *input;
+struct ring *output;
+struct cmdq *keys;
+struct cmdq *parsed;
+struct chbuf *pending;
 pthread_t output_thread;
-
-void bind (unsigned force_mode, unsigned block_mode, long unsigned key, unsigned char *str)
+int output_event = -1;
+int stop_event = -1;
+unsigned char *shm_name = "";
+struct shm_ring *shm;
+size_t shm_skip;
+char shm_corrupt = 0;
+atomic_char shm_stopping = 0;
+
+// Bindings are compiled to commands here, once, rather than parsed again
+// on every keypress. A leading '0' in str is skipped.
+void bind_key (unsigned force_mode, unsigned block_mode, long unsigned key, unsigned char *str)
 {
 	struct binding *binding;
+	struct cmdq *cmdq = new_cmdq();
+
+	if (!cmdq)
+		return;
+
+	cmdq_append(cmdq, str[0] == '0' ? str + 1 : str);
 
 	key = lokey(key);
 
@@ -67,28 +93,28 @@ void bind (unsigned force_mode, unsigned block_mode, long unsigned key, unsigned
 	     binding;
 	     binding = binding->next) {
 		if (binding->force_mode == force_mode &&
-		    binding->block_mode == block_mode) {
-			if (binding->str[0] == 0)
-				free(binding->str);
-			binding->str = str;
-			return;
-		}
+		    binding->block_mode == block_mode)
+			break;
 	}
 
-	binding = malloc(sizeof(struct binding));
-
 	if (!binding) {
-		fprintf(stderr,
-		        "Error allocating memory.\n"
-		        "Could not bind key.\n");
-		return;
-	}
-
-	binding->force_mode = force_mode;
-	binding->block_mode = block_mode;
-	binding->str = str;
-	binding->next = keybind[key];
-	keybind[key] = binding;
+		binding = malloc(sizeof(struct binding));
+		if (!binding) {
+			fprintf(stderr,
+			        "Error allocating memory.\n"
+			        "Could not bind key.\n");
+			destroy_cmdq(&cmdq);
+			return;
+		}
+		binding->force_mode = force_mode;
+		binding->block_mode = block_mode;
+		binding->next = keybind[key];
+		keybind[key] = binding;
+	} else free(binding->cmd);
+
+	binding->num_cmds = cmdq->len;
+	binding->cmd = cmdq->cmd;
+	free(cmdq);
 }
 
 struct chbuf *new_chbuf()
@@ -105,94 +131,239 @@ struct chbuf *new_chbuf()
 		return NULL;
 	}
 
-	chbuf->lock  = 0;
 	chbuf->size  = CHBUF_INIT_SIZE;
 	chbuf->len   = 0;
+	chbuf->skip  = 0;
 	chbuf->ch[0] = 0;
 
 	return chbuf;
 }
 
-int chbuf_push (struct chbuf *chbuf, unsigned char ch)
+// Make room for len more characters and the terminator.
+int chbuf_reserve (struct chbuf *chbuf, size_t len)
 {
-	lock(chbuf);
+	size_t size = chbuf->size;
+	unsigned char *ch;
 
-	unsigned char *new_ch;
+	while (chbuf->len + len >= size)
+		size *= 2;
+	if (size == chbuf->size)
+		return 1;
 
-	if (chbuf->len == chbuf->size - 1) {
-		new_ch = malloc(chbuf->size + CHBUF_CHUNK_SIZE);
-		if (!new_ch) {
-			fprintf(stderr,
-			        "Error allocating memory.\n"
-			        "Could not update character buffer.\n");
-			unlock(chbuf);
-			return 0;
-		}
-		chbuf->size += CHBUF_CHUNK_SIZE;
-		for (size_t i = 0; i < chbuf->len; i++)
-			new_ch[i] = chbuf->ch[i];
-		free(chbuf->ch);
-		chbuf->ch = new_ch;
+	ch = realloc(chbuf->ch, size);
+	if (!ch) {
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Could not update character buffer.\n");
+		return 0;
 	}
 
-	chbuf->ch[chbuf->len] = ch;
-	chbuf->len += 1;
-	chbuf->ch[chbuf->len] = 0;
-
-	unlock(chbuf);
+	chbuf->ch = ch;
+	chbuf->size = size;
 
 	return 1;
 }
 
-int chbuf_append (struct chbuf *chbuf, unsigned char *str)
+void destroy_chbuf (struct chbuf **chbuf_p)
 {
-	lock(chbuf);
+	struct chbuf *chbuf = *chbuf_p;
+	if (!chbuf) return;
 
-	size_t new_len = chbuf->len + strlen(str);
-	size_t new_size = chbuf->size;
-	while (new_len > new_size)
-		new_size += CHBUF_CHUNK_SIZE;
+	free(chbuf->ch);
+	free(chbuf);
+	*chbuf_p = NULL;
+}
 
-	unsigned char *new_ch;
+struct cmdq *new_cmdq ()
+{
+	struct cmdq *cmdq = malloc(sizeof(struct cmdq));
+	if (cmdq)
+		cmdq->cmd = malloc(CMDQ_INIT_SIZE * sizeof(struct command));
 
-	if (new_size > chbuf->size) {
-		new_ch = malloc(new_size);
-		if (!new_ch) {
-			fprintf(stderr,
-			        "Error allocating memory.\n"
-			        "Could not update character buffer.\n");
-			unlock(chbuf);
-			return 0;
-		}
-		for (size_t i = 0; i < chbuf->len; i++)
-			new_ch[i] = chbuf->ch[i];
-		free(chbuf->ch);
-		chbuf->ch = new_ch;
+	if (!cmdq || !cmdq->cmd) {
+		if (cmdq) free(cmdq);
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Could not create command queue.\n");
+		return NULL;
 	}
 
-	for (size_t i = chbuf->len; i < new_len; i++)
-		chbuf->ch[i] = str[i - chbuf->len];
-	chbuf->ch[new_len] = 0;
+	cmdq->size = CMDQ_INIT_SIZE;
+	cmdq->len  = 0;
 
-	chbuf->size = new_size;
-	chbuf->len = new_len;
+	return cmdq;
+}
+
+int cmdq_reserve (struct cmdq *cmdq, size_t len)
+{
+	size_t size = cmdq->size;
+	struct command *cmd;
+
+	while (cmdq->len + len > size)
+		size *= 2;
+	if (size == cmdq->size)
+		return 1;
 
-	unlock(chbuf);
+	cmd = realloc(cmdq->cmd, size * sizeof(struct command));
+	if (!cmd) {
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Could not update command queue.\n");
+		return 0;
+	}
+
+	cmdq->cmd = cmd;
+	cmdq->size = size;
 
 	return 1;
 }
 
-void destroy_chbuf (struct chbuf **chbuf_p)
+int cmdq_push (struct cmdq *cmdq, struct command *cmd)
 {
-	struct chbuf *chbuf = *chbuf_p;
-	free(chbuf->ch);
-	free(chbuf);
-	*chbuf_p = NULL;
+	if (!cmdq_reserve(cmdq, 1))
+		return 0;
+
+	cmdq->cmd[cmdq->len++] = *cmd;
+
+	return 1;
+}
+
+// Parse a string of commands onto the queue.
+int cmdq_append (struct cmdq *cmdq, unsigned char *str)
+{
+	struct chbuf view;
+	size_t len = cmdq->len;
+
+	view.ch = str;
+	view.len = view.size = strlen(str);
+	view.skip = 0;
+	parse_commands(&view, cmdq);
+
+	return cmdq->len > len;
+}
+
+void destroy_cmdq (struct cmdq **cmdq_p)
+{
+	struct cmdq *cmdq = *cmdq_p;
+	if (!cmdq) return;
+
+	free(cmdq->cmd);
+	free(cmdq);
+	*cmdq_p = NULL;
+}
+
+struct ring *new_ring (size_t size)
+{
+	struct ring *ring = aligned_alloc(CACHE_LINE, sizeof(struct ring));
+	size_t pow = RING_MIN_SIZE;
+
+	while (pow < size)
+		pow *= 2;
+
+	if (ring)
+		ring->ch = malloc(pow);
+
+	if (!ring || !ring->ch) {
+		if (ring) free(ring);
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Could not create ring buffer.\n");
+		return NULL;
+	}
+
+	ring->size = pow;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->waiting, 0);
+	atomic_init(&ring->closed, 0);
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->space, NULL);
+
+	return ring;
+}
+
+void destroy_ring (struct ring **ring_p)
+{
+	struct ring *ring = *ring_p;
+	if (!ring) return;
+
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->space);
+	free(ring->ch);
+	free(ring);
+	*ring_p = NULL;
+}
+
+// Producer side. Copies as much of src as fits and returns the count.
+size_t ring_write (struct ring *ring, unsigned char *src, size_t len)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load(&ring->head);
+	size_t at = tail & (ring->size - 1);
+	size_t first;
+
+	if (len > ring->size - (tail - head))
+		len = ring->size - (tail - head);
+	first = ring->size - at < len ? ring->size - at : len;
+
+	memcpy(ring->ch + at, src, first);
+	memcpy(ring->ch, src + first, len - first);
+	atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+
+	return len;
+}
+
+// Consumer side. Copies up to len bytes out and wakes a waiting producer.
+size_t ring_read (struct ring *ring, unsigned char *dest, size_t len)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t at = head & (ring->size - 1);
+	size_t first;
+
+	if (len > tail - head)
+		len = tail - head;
+	if (!len)
+		return 0;
+	first = ring->size - at < len ? ring->size - at : len;
+
+	memcpy(dest, ring->ch + at, first);
+	memcpy(dest + first, ring->ch, len - first);
+	atomic_store(&ring->head, head + len);
+
+	if (atomic_load(&ring->waiting)) {
+		pthread_mutex_lock(&ring->lock);
+		pthread_cond_signal(&ring->space);
+		pthread_mutex_unlock(&ring->lock);
+	}
+
+	return len;
+}
+
+// Producer side. Blocks until the ring has space or is closed.
+void ring_wait (struct ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	atomic_store(&ring->waiting, 1);
+	while (!atomic_load(&ring->closed) &&
+	       atomic_load(&ring->tail) - atomic_load(&ring->head) == ring->size)
+		pthread_cond_wait(&ring->space, &ring->lock);
+	atomic_store(&ring->waiting, 0);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+// Release a producer blocked in ring_wait for good.
+void ring_close (struct ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	atomic_store(&ring->closed, 1);
+	pthread_cond_broadcast(&ring->space);
+	pthread_mutex_unlock(&ring->lock);
 }
 
 #define capswitch(a, b) ((mod & KMOD_SHIFT) ? b : a)
 
-int append_keypress (struct chbuf *chbuf, SDL_Keymod mod, long unsigned key)
+int append_keypress (struct cmdq *cmdq, SDL_Keymod mod, long unsigned key)
 {
 	mode = (mode & ~MOD_KEY_MASK) |
 	       ((mod & KMOD_ALT)   ? ALT_DOWN   : 0) |
@@ -208,13 +379,12 @@ int append_keypress (struct chbuf *chbuf, SDL_Keymod mod, long unsigned key)
 	     binding = binding->next) {
 		if ((mode & binding->force_mode) == binding->force_mode &&
 		    !(mode & binding->block_mode) &&
-		    binding->str) {
-			if (binding->str[0] == '0') {
-				if (chbuf_append(chbuf,
-				                 binding->str + 1))
-					bound = 1;
-			} else if (chbuf_append(chbuf, binding->str))
-				bound = 1;
+		    cmdq_reserve(cmdq, binding->num_cmds)) {
+			memcpy(cmdq->cmd + cmdq->len,
+			       binding->cmd,
+			       binding->num_cmds * sizeof(struct command));
+			cmdq->len += binding->num_cmds;
+			bound = 1;
 		}
 	}
 
@@ -248,9 +418,9 @@ int append_keypress (struct chbuf *chbuf, SDL_Keymod mod, long unsigned key)
 		case SDLK_9:
 			ch = capswitch('9', '('); break;
 		case SDLK_KP_000:
-			return chbuf_append(chbuf, "000");
+			return cmdq_append(cmdq, "000");
 		case SDLK_KP_00:
-			return chbuf_append(chbuf, "00");
+			return cmdq_append(cmdq, "00");
 		case SDLK_KP_0:
 			ch = '0'; break;
 		case SDLK_KP_1:
@@ -291,7 +461,7 @@ int append_keypress (struct chbuf *chbuf, SDL_Keymod mod, long unsigned key)
 		case SDLK_KP_E:
 			ch = 'E'; break;
 		case SDLK_KP_DBLAMPERSAND:
-			return chbuf_append(chbuf, "&&");
+			return cmdq_append(cmdq, "&&");
 		case SDLK_KP_AMPERSAND:
 			ch = '&'; break;
 		case SDLK_KP_AT:
@@ -301,7 +471,7 @@ int append_keypress (struct chbuf *chbuf, SDL_Keymod mod, long unsigned key)
 		case SDLK_KP_COMMA:
 			ch = ','; break;
 		case SDLK_KP_DBLVERTICALBAR:
-			return chbuf_append(chbuf, "||");
+			return cmdq_append(cmdq, "||");
 		case SDLK_KP_VERTICALBAR:
 			ch = '|'; break;
 		case SDLK_KP_DECIMAL:
@@ -325,7 +495,7 @@ int append_keypress (struct chbuf *chbuf, SDL_Keymod mod, long unsigned key)
 		case SDLK_KP_LESS:
 			ch = '<'; break;
 		case SDLK_KP_PLUSMINUS:
-			return chbuf_append(chbuf, "+-");
+			return cmdq_append(cmdq, "+-");
 		case SDLK_KP_MINUS:
 			ch = '-'; break;
 		case SDLK_KP_MULTIPLY:
@@ -358,7 +528,7 @@ int append_keypress (struct chbuf *chbuf, SDL_Keymod mod, long unsigned key)
 		case SDLK_SLASH:
 			ch = capswitch('/', '?'); break;
 		case SDLK_WWW:
-			return chbuf_append(chbuf, "www");
+			return cmdq_append(cmdq, "www");
 		case SDLK_AMPERSAND:
 			ch = '&'; break;
 		case SDLK_ASTERISK:
@@ -401,18 +571,28 @@ int append_keypress (struct chbuf *chbuf, SDL_Keymod mod, long unsigned key)
 
 	if (!ch) return 0;
 
-	return chbuf_push(chbuf, ch);
+	struct command cmd = {0};
+
+	if (ch == '\n') {
+		cmd.op = CMD_NEWLINE;
+		cmd.b = 2;
+	} else {
+		cmd.op = CMD_TYPE;
+		cmd.glyph = ch;
+	}
+
+	return cmdq_push(cmdq, &cmd);
 }
 
 void handle_keypress (SDL_Keymod mod, long unsigned key)
 {
-	append_keypress(stream, mod, lokey(key));
+	append_keypress(keys, mod, lokey(key));
 }
 
 size_t find_csi_end (struct chbuf *chbuf, size_t *i_p)
 {
 	size_t i = *i_p;
-	while (chbuf->ch[i] && chbuf->ch[i] != '\007')
+	while (chbuf_at(chbuf, i) && chbuf->ch[i] != '\007')
 		i++;
 	*i_p = i;
 }
@@ -423,18 +603,18 @@ int grab_int (struct chbuf *chbuf, size_t *i_p, int def)
 	int n = 0;
 	size_t i = *i_p;
 
-	if (chbuf->ch[i] == '-') {
+	if (chbuf_at(chbuf, i) == '-') {
 		neg = 1;
 		i++;
 	}
 
-	if (chbuf->ch[i] < '0' || chbuf->ch[i] > '9') {
+	if (chbuf_at(chbuf, i) < '0' || chbuf_at(chbuf, i) > '9') {
 		return def;
-	} else while (chbuf->ch[i] >= '0' && chbuf->ch[i] <= '9') {
+	} else while (chbuf_at(chbuf, i) >= '0' && chbuf_at(chbuf, i) <= '9') {
 		n = n * 10 + chbuf->ch[i] - '0';
 		i++;
 	}
-	if (chbuf->ch[i] == ';')
+	if (chbuf_at(chbuf, i) == ';')
 		i++;
 
 	*i_p = i;
@@ -442,73 +622,343 @@ int grab_int (struct chbuf *chbuf, size_t *i_p, int def)
 	return (neg ? -n : n);
 }
 
-int csi_handle (struct buffer *buf, struct chbuf *chbuf, size_t *i_p)
+int csi_parse (struct chbuf *chbuf, size_t *i_p, struct cmdq *cmdq)
 {
 	size_t i = *i_p;
-	size_t j;
-	double ratio;
-	unsigned char return_buffer[20];
-
-	int a, b, c;
+	struct command cmd = {0};
+	unsigned char op;
 
-	if (chbuf->ch[i++] != '\033')
+	if (chbuf_at(chbuf, i) != '\033')
 		return 0;
+	op = chbuf_at(chbuf, i + 1);
+	i += 2;
 
-	switch (chbuf->ch[i++]) {
+	switch (op) {
 		case 'A':
-			a = grab_int(chbuf, &i, buf->ptr_col);
-			b = grab_int(chbuf, &i, buf->ptr_row);
-			do_absmove(curbuf, a, b);
+			cmd.op = CMD_MOVE;
+			cmd.a = grab_int(chbuf, &i, ARG_DEFAULT);
+			cmd.b = grab_int(chbuf, &i, ARG_DEFAULT);
 			break;
 		case 'Q':
-			do_quit();
+			cmd.op = CMD_QUIT;
+			break;
+		case 'P':
+			cmd.op = CMD_QUERY;
 			break;
 		case 'Z':
-			a = grab_int(chbuf, &i, 0);
-			b = grab_int(chbuf, &i, 0);
-			c = grab_int(chbuf, &i, 0);
-			do_test(curbuf, a, b, c);
+			cmd.op = CMD_TEST;
+			cmd.a = grab_int(chbuf, &i, 0);
+			cmd.b = grab_int(chbuf, &i, 0);
+			cmd.c = grab_int(chbuf, &i, 0);
 			break;
 		default:
 			break;
 	}
 	find_csi_end(chbuf, &i);
 
+	if (cmd.op)
+		cmdq_push(cmdq, &cmd);
+
 	*i_p = i;
 
 	return 1;
 }
 
-void chbuf_handle (struct buffer *buf, struct chbuf *chbuf)
+#define frame_u16(p) ((p)[0] | (p)[1] << 8)
+
+void frame_parse (unsigned char op, unsigned char *p, Uint32 len, struct cmdq *cmdq)
 {
-	lock(chbuf);
+	struct command *cmd;
+
+	switch (op) {
+		case FRAME_STROKES:
+			if (!cmdq_reserve(cmdq, len / 6))
+				break;
+			for (Uint32 k = 0; k + 6 <= len; k += 6) {
+				cmd = cmdq->cmd + cmdq->len++;
+				cmd->op = CMD_PLACE;
+				cmd->a = frame_u16(p + k);
+				cmd->b = frame_u16(p + k + 2);
+				cmd->color = p[k + 4];
+				cmd->glyph = p[k + 5];
+			}
+			break;
+		case FRAME_RUN:
+			if (len < 5 || !cmdq_reserve(cmdq, len - 5))
+				break;
+			for (Uint32 k = 5; k < len; k++) {
+				cmd = cmdq->cmd + cmdq->len++;
+				cmd->op = CMD_PLACE;
+				cmd->a = frame_u16(p) + k - 5;
+				cmd->b = frame_u16(p + 2);
+				cmd->color = p[4];
+				cmd->glyph = p[k];
+			}
+			break;
+		case FRAME_CLEAR:
+			if (len >= 8 && cmdq_reserve(cmdq, 1)) {
+				cmd = cmdq->cmd + cmdq->len++;
+				cmd->op = CMD_CLEAR;
+				cmd->a = frame_u16(p);
+				cmd->b = frame_u16(p + 2);
+				cmd->c = frame_u16(p + 4);
+				cmd->d = frame_u16(p + 6);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+// Parses the binary frame at *i_p. Returns 0 if it has not all arrived
+// yet. A frame too long to buffer is thrown away whole, the part still
+// to come through chbuf->skip, so none of its payload is read as text.
+int frame_handle (struct chbuf *chbuf, size_t *i_p, struct cmdq *cmdq)
+{
+	unsigned char *p = chbuf->ch + *i_p;
+	size_t left = chbuf->len - *i_p;
+	Uint32 len;
+
+	if (left < FRAME_HEADER)
+		return 0;
+
+	len = p[3] | p[4] << 8 | p[5] << 16 | (Uint32) p[6] << 24;
+	if (len > FRAME_MAX) {
+		chbuf->skip = FRAME_HEADER + (size_t) len;
+		if (left > chbuf->skip)
+			left = chbuf->skip;
+		chbuf->skip -= left;
+		*i_p += left - 1;
+		fprintf(stderr,
+		        "Frame of %u bytes is too long.\n"
+		        "Frame was skipped.\n",
+		        len);
+		return 1;
+	}
+	if (left - FRAME_HEADER < len)
+		return 0;
+
+	frame_parse(p[2], p + FRAME_HEADER, len, cmdq);
+	*i_p += FRAME_HEADER + len - 1;
+
+	return 1;
+}
 
-	for (size_t i = 0; i < chbuf->len; i++) {
-		if (csi_handle(buf, chbuf, &i)) {
+// Parses every complete command in chbuf onto cmdq and returns how many
+// bytes they took. A command cut off by the end of the buffer is left
+// for the next call, but an escape with no BEL within CSI_MAX bytes is
+// dropped, so it cannot hold back what follows. chbuf may be a view into
+// memory we do not own.
+size_t parse_commands (struct chbuf *chbuf, struct cmdq *cmdq)
+{
+	struct command cmd = {0};
+	size_t i, left;
+
+	i = chbuf->skip < chbuf->len ? chbuf->skip : chbuf->len;
+	chbuf->skip -= i;
+
+	for (; i < chbuf->len; i++) {
+		if (chbuf->ch[i] == '\033' && chbuf_at(chbuf, i + 1) == 'F') {
+			if (!frame_handle(chbuf, &i, cmdq))
+				break;
+		} else if (chbuf->ch[i] == '\033') {
+			left = chbuf->len - i;
+			if (left > CSI_MAX)
+				left = CSI_MAX;
+			if (memchr(chbuf->ch + i, '\007', left))
+				csi_parse(chbuf, &i, cmdq);
+			else if (left < CSI_MAX)
+				break;
+			else
+				fprintf(stderr,
+				        "Control sequence has no end.\n"
+				        "Escape was skipped.\n");
 		} else if (chbuf->ch[i] == '\n') {
-			do_absmove(buf,
-			           0,
-			           buf->ptr_row + grab_int(chbuf, &i, 2));
+			cmd.op = CMD_NEWLINE;
+			cmd.b = grab_int(chbuf, &i, 2);
+			cmdq_push(cmdq, &cmd);
 		} else {
-			do_type(buf, chbuf->ch[i]);
+			cmd.op = CMD_TYPE;
+			cmd.glyph = chbuf->ch[i];
+			cmdq_push(cmdq, &cmd);
 		}
 	}
 
-	chbuf->len = 0;
+	return i < chbuf->len ? i : chbuf->len;
+}
+
+void run_command (struct buffer *buf, struct command *cmd)
+{
+	unsigned char reply[32];
+	int len;
+
+	switch (cmd->op) {
+		case CMD_TYPE:
+			do_type(buf, cmd->glyph);
+			break;
+		case CMD_NEWLINE:
+			do_absmove(buf, 0, buf->ptr_row + cmd->b);
+			break;
+		case CMD_MOVE:
+			do_absmove(buf,
+			           cmd->a == ARG_DEFAULT ? buf->ptr_col : cmd->a,
+			           cmd->b == ARG_DEFAULT ? buf->ptr_row : cmd->b);
+			break;
+		case CMD_QUIT:
+			do_quit();
+			break;
+		case CMD_QUERY:
+			len = snprintf(reply,
+			               sizeof(reply),
+			               "\033P%i;%i\007",
+			               buf->ptr_col,
+			               buf->ptr_row);
+			control_reply(reply, len);
+			break;
+		case CMD_TEST:
+			do_test(buf, cmd->a, cmd->b, cmd->c);
+			break;
+		case CMD_PLACE:
+			do_place(buf, cmd->a, cmd->b, cmd->color, cmd->glyph);
+			break;
+		case CMD_CLEAR:
+			do_clear(buf, cmd->a, cmd->b, cmd->c, cmd->d);
+			break;
+		default:
+			break;
+	}
+}
+
+// Runs and empties the queue.
+void run_cmdq (struct buffer *buf, struct cmdq *cmdq)
+{
+	for (size_t k = 0; k < cmdq->len; k++)
+		run_command(buf, cmdq->cmd + k);
+	cmdq->len = 0;
+}
+
+void chbuf_handle (struct buffer *buf, struct chbuf *chbuf)
+{
+	size_t i = parse_commands(chbuf, parsed);
+
+	memmove(chbuf->ch, chbuf->ch + i, chbuf->len - i);
+	chbuf->len -= i;
+	chbuf->ch[chbuf->len] = 0;
+
+	run_cmdq(buf, parsed);
+}
+
+// Consume commands straight out of the shared memory ring. Parsing copies
+// them out, so the space goes back to the producer before they run. When
+// nothing complete is left we flag ourselves idle, so the producer's next
+// commit wakes shm_loop and through it the GUI. The producer owns tail,
+// so a tail more than a ring ahead means the ring is corrupt and is left
+// alone from then on. A full ring that still parses to nothing can never
+// make progress, so its first byte is dropped.
+int shm_handle (struct buffer *buf)
+{
+	struct shm_header *header = shm->header;
+	unsigned head = atomic_load_explicit(&header->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&header->tail, memory_order_acquire);
+	struct chbuf view;
+	size_t used;
+
+	if (shm_corrupt)
+		return 0;
+	if (tail - head > shm->size) {
+		fprintf(stderr,
+		        "Shared memory ring is corrupt.\n"
+		        "Stopped reading from it.\n");
+		shm_corrupt = 1;
+		return 0;
+	}
+
+	view.ch = shm->data + (head & (shm->size - 1));
+	view.len = tail - head < CTRL_QUANTUM ? tail - head : CTRL_QUANTUM;
+	view.size = view.len;
+	view.skip = shm_skip;
+	used = parse_commands(&view, parsed);
+	if (!used && view.len < tail - head) {
+		view.len = view.size = tail - head;
+		used = parse_commands(&view, parsed);
+	}
+	shm_skip = view.skip;
+
+	if (!used && tail - head == shm->size) {
+		fprintf(stderr,
+		        "Shared memory ring is full of unparseable input.\n"
+		        "Dropped its first byte.\n");
+		used = 1;
+	}
+
+	if (!used) {
+		atomic_store(&header->consumer_waiting, 1);
+		if (atomic_load(&header->tail) == tail)
+			return 0;
+		atomic_store(&header->consumer_waiting, 0);
+		return 1;
+	}
+
+	atomic_store(&header->head, head + used);
+	if (atomic_exchange(&header->producer_waiting, 0))
+		shm_futex_wake(&header->head);
+
+	run_cmdq(buf, parsed);
 
-	unlock(chbuf);
+	return 1;
 }
 
-void control_handle (struct buffer *buf)
+// Keypresses first, then a bounded number of passes over the input ring,
+// the shared memory ring and the socket clients, one quantum each per
+// pass, so neither a flood of control data nor one busy client can
+// starve drawing or the others.
+int control_handle (struct buffer *buf)
 {
-	if (stream->len)
-		chbuf_handle(buf, stream);
+	int handled = 0;
+	int progress;
+	size_t n;
+
+	if (keys->len) {
+		run_cmdq(buf, keys);
+		handled = 1;
+	}
+
+	for (int pass = 0; pass < RING_DRAIN_PASSES; pass++) {
+		progress = server_handle();
+		if (shm && shm_handle(buf))
+			progress = 1;
+		if (chbuf_reserve(pending, CTRL_QUANTUM) &&
+		    (n = ring_read(input, pending->ch + pending->len, CTRL_QUANTUM))) {
+			pending->len += n;
+			pending->ch[pending->len] = 0;
+			chbuf_handle(buf, pending);
+			progress = 1;
+		}
+		if (!progress)
+			break;
+		handled = 1;
+	}
+
+	return handled;
 }
 
 void cleanup_control ()
 {
-	destroy_chbuf(&stream);
-	destroy_chbuf(&return_stream);
+	destroy_ring(&input);
+	destroy_ring(&output);
+	destroy_cmdq(&keys);
+	destroy_cmdq(&parsed);
+	destroy_chbuf(&pending);
+	cleanup_server();
+	shm_ring_destroy(&shm);
+	shm_skip = 0;
+	shm_corrupt = 0;
+	if (output_event >= 0)
+		close(output_event);
+	if (stop_event >= 0)
+		close(stop_event);
+	output_event = -1;
+	stop_event = -1;
 
 	struct binding *next_binding;
 
@@ -517,76 +967,210 @@ void cleanup_control ()
 		     binding;
 		     binding = next_binding) {
 			next_binding = binding->next;
-			if (binding->str && !binding->str[0])
-				free(binding->str);
+			free(binding->cmd);
 			free(binding);
 		}
 	}
 }
 
+// Queue a reply for the socket client being served, or else for the
+// output pipe. Called from the GUI thread, which never waits: whatever
+// does not fit in the ring is dropped.
+void control_reply (unsigned char *str, size_t len)
+{
+	if (server_reply(str, len))
+		return;
+
+	if (!output || ring_write(output, str, len) < len)
+		fprintf(stderr,
+		        "Output pipe is full.\n"
+		        "Reply was dropped.\n");
+	if (output_event >= 0)
+		eventfd_write(output_event, 1);
+}
+
+// Wait for fd to be ready for events, or for stop_event. Returns 0 once
+// we are stopping.
+int wait_fd (int fd, short events)
+{
+	struct pollfd pfd[2] = {{fd, events, 0}, {stop_event, POLLIN, 0}};
+
+	while (poll(pfd, 2, -1) < 0) {
+		if (errno != EINTR)
+			return 0;
+	}
+
+	return !pfd[1].revents;
+}
+
+int write_all (int fd, unsigned char *src, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, src, len);
+		if (n > 0) {
+			src += n;
+			len -= n;
+		} else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			return 0;
+		} else if (!wait_fd(fd, POLLOUT))
+			return 0;
+	}
+
+	return 1;
+}
+
+// Sleeps on output_event and drains the output ring into the pipe. The
+// pipe is opened read-write so replies queue in it until a reader turns
+// up, instead of the open blocking.
 void *output_loop (void *params)
 {
+	unsigned char *ch = malloc(CTRL_READ_SIZE);
+	eventfd_t count;
+	size_t n;
 	int fd;
 
 	mkfifo(fifo_out, 0666);
+	fd = open(fifo_out, O_RDWR | O_NONBLOCK);
 
-	while (1) {
-		if (return_stream->len) {
-			lock(return_stream);
-
-			fd = open(fifo_out, O_WRONLY);
-			write(fd, return_stream->ch, return_stream->len);
-			close(fd);
-			return_stream->len = 0;
+	if (!ch || fd < 0) {
+		fprintf(stderr,
+		        "Could not open %s.\n"
+		        "Output pipe is disabled.\n",
+		        fifo_out);
+		free(ch);
+		return NULL;
+	}
 
-			unlock(return_stream);
+	while (wait_fd(output_event, POLLIN)) {
+		eventfd_read(output_event, &count);
+		while ((n = ring_read(output, ch, CTRL_READ_SIZE))) {
+			if (!write_all(fd, ch, n))
+				break;
 		}
 	}
 
+	close(fd);
+	free(ch);
+
 	return NULL;
 }
 
-void cleanup_control_loop (void *params)
+// Hand input to the GUI thread, holding the FIFO reader back while the
+// ring is full.
+void push_input (unsigned char *src, size_t len)
 {
-	pthread_cancel(output_thread);
+	size_t n;
+
+	while (len && !atomic_load(&input->closed)) {
+		n = ring_write(input, src, len);
+		src += n;
+		len -= n;
+		gui_wake();
+		if (len)
+			ring_wait(input);
+	}
+}
 
-	struct chbuf *chbuf = params;
-	destroy_chbuf(&chbuf);
+// Sleeps on the ring's wake counter, which a producer bumps when it
+// commits to a ring the GUI had found empty.
+void *shm_loop (void *params)
+{
+	unsigned wake;
+
+	while (!atomic_load(&shm_stopping)) {
+		wake = atomic_load(&shm->header->wake);
+		gui_wake();
+		if (!atomic_load(&shm_stopping))
+			shm_futex_wait(&shm->header->wake, wake);
+	}
+
+	return NULL;
 }
 
+// Reads the input pipe in large chunks whenever poll says it has data.
+// We hold a write end of our own, so the pipe never reports end of file
+// and writers can come and go without it being reopened. The output,
+// socket and shared memory threads are started from here and joined on
+// the way out.
 void *control_loop (void *params)
 {
-	struct chbuf *chbuf = new_chbuf();
+	unsigned char *ch = malloc(CTRL_READ_SIZE);
+	pthread_t server_thread;
+	pthread_t shm_thread;
+	char output_running = 0;
+	char server_running = 0;
+	char shm_running = 0;
+	ssize_t n;
+	int fd;
+	int hold = -1;
 
-	pthread_cleanup_push(cleanup_control_loop, chbuf);
+	if (pthread_create(&server_thread, NULL, server_loop, NULL)) {
+		fprintf(stderr,
+		        "Error creating thread.\n"
+		        "Could not create socket server.\n");
+	} else server_running = 1;
 
-//	if (pthread_create(&output_thread, NULL, output_loop, NULL))
-//		fprintf(stderr,
-//		        "Error creating thread.\n"
-//		        "Could not create output pipe.\n");
+	if (shm) {
+		if (pthread_create(&shm_thread, NULL, shm_loop, NULL)) {
+			fprintf(stderr,
+			        "Error creating thread.\n"
+			        "Could not wait on shared memory ring.\n");
+		} else shm_running = 1;
+	}
 
 	mkfifo(fifo_in, 0666);
+	fd = open(fifo_in, O_RDONLY | O_NONBLOCK);
+	if (fd >= 0)
+		hold = open(fifo_in, O_WRONLY);
 
-	int fd;
-	unsigned char ch;
-
-	while (1) {
-		chbuf->len = 0;
-
-		fd = open(fifo_in, O_RDONLY);
-		while (read(fd, &ch, 1))
-			chbuf_push(chbuf, ch);
-		close(fd);
+	if (!ch || fd < 0 || hold < 0) {
+		fprintf(stderr,
+		        "Could not open %s.\n"
+		        "Input pipe is disabled.\n",
+		        fifo_in);
+	} else {
+		if (pthread_create(&output_thread, NULL, output_loop, NULL)) {
+			fprintf(stderr,
+			        "Error creating thread.\n"
+			        "Could not create output pipe.\n");
+		} else output_running = 1;
 
-		if (chbuf->len)
-			chbuf_append(stream, chbuf->ch);
+		while (wait_fd(fd, POLLIN)) {
+			while ((n = read(fd, ch, CTRL_READ_SIZE)) > 0)
+				push_input(ch, n);
+		}
 	}
 
-	pthread_cleanup_pop(0);
+	if (output_running)
+		pthread_join(output_thread, NULL);
+	if (server_running)
+		pthread_join(server_thread, NULL);
+	if (shm_running)
+		pthread_join(shm_thread, NULL);
+	if (hold >= 0)
+		close(hold);
+	if (fd >= 0)
+		close(fd);
+	free(ch);
 
 	return NULL;
 }
 
+// Ask control_loop and the threads it started to finish.
+void stop_control ()
+{
+	ring_close(input);
+	if (shm) {
+		atomic_store(&shm_stopping, 1);
+		atomic_fetch_add(&shm->header->wake, 1);
+		shm_futex_wake(&shm->header->wake);
+	}
+	if (stop_event >= 0)
+		eventfd_write(stop_event, 1);
+}
+
 unsigned char *CSI_QUIT = "\033Q\007";
 
 unsigned char *CSI_PTR_LEFT = "\033A0;0\007";
@@ -597,15 +1181,27 @@ unsigned char *CSI_TEST = "\033Z12;34;56;78\007";
 
 void init_control ()
 {
-	stream = new_chbuf();
-	return_stream = new_chbuf();
+	input = new_ring(ring_size);
+	output = new_ring(ring_size);
+	keys = new_cmdq();
+	parsed = new_cmdq();
+	pending = new_chbuf();
+	output_event = eventfd(0, EFD_CLOEXEC);
+	stop_event = eventfd(0, EFD_CLOEXEC);
+	init_server();
+
+	if (shm_name[0] && !(shm = shm_ring_create(shm_name, SHM_DEFAULT_SIZE)))
+		fprintf(stderr,
+		        "Could not create shared memory %s.\n"
+		        "Shared memory ring is disabled.\n",
+		        shm_name);
 
-	bind(ALT_DOWN, 0, SDLK_F4, CSI_QUIT);
+	bind_key(ALT_DOWN, 0, SDLK_F4, CSI_QUIT);
 
-	bind(0, 0, SDLK_UP, CSI_PTR_UP);
-	bind(0, 0, SDLK_DOWN, CSI_PTR_DOWN);
-	bind(0, 0, SDLK_LEFT, CSI_PTR_LEFT);
-	bind(0, 0, SDLK_RIGHT, CSI_PTR_RIGHT);
+	bind_key(0, 0, SDLK_UP, CSI_PTR_UP);
+	bind_key(0, 0, SDLK_DOWN, CSI_PTR_DOWN);
+	bind_key(0, 0, SDLK_LEFT, CSI_PTR_LEFT);
+	bind_key(0, 0, SDLK_RIGHT, CSI_PTR_RIGHT);
 
-	bind(0, 0, SDLK_RETURN, CSI_TEST);
+	bind_key(0, 0, SDLK_RETURN, CSI_TEST);
 }
@@ -0,0 +1,509 @@
+#include <SDL2/SDL_image.h>
+#include <SDL2/SDL.h>
+#include <X11/Xlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ctype.h>
+#include <math.h>
+#include "type.h"
+
+#define FONT_CACHE_EXT ".cache"
+#define FONT_CACHE_VERSION 0
+
+unsigned font_mode = FONT_PARALLEL;
+
+struct glyph *new_glyph (unsigned char *ink, int ink_pitch, SDL_Rect box, int num_spans)
+{
+	int pitch = (box.w + 7) / 8;
+	size_t spans_at = (sizeof(struct glyph) +
+	                   (box.h + 1) * sizeof(Uint16) + 3) & ~3;
+	size_t bits_at = spans_at + num_spans * sizeof(struct span);
+	size_t size = (bits_at + box.h * pitch + 7) & ~7;
+
+	struct glyph *glyph = calloc(1, size);
+
+	if (!glyph) {
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Could not load glyph.\n");
+		return NULL;
+	}
+
+	glyph->size = size;
+	glyph->x = box.x;
+	glyph->y = box.y;
+	glyph->w = box.w;
+	glyph->h = box.h;
+	glyph->pitch = pitch;
+	glyph->num_spans = num_spans;
+	glyph->spans = spans_at;
+	glyph->bits = bits_at;
+
+	Uint16 *rows = glyph_rows(glyph);
+	struct span *span = glyph_spans(glyph);
+	Uint8 *bits = glyph_bits(glyph);
+	unsigned char *src;
+	int n = 0;
+	int cx;
+
+	for (int y = 0; y < box.h; y++) {
+		rows[y] = n;
+		src = ink + (box.y + y) * ink_pitch;
+		for (int x = 0; x < box.w; x++) {
+			cx = box.x + x;
+			if (!(src[cx / 8] & (0x80 >> (cx & 7))))
+				continue;
+			bits[y * pitch + x / 8] |= 0x80 >> (x & 7);
+			if (n > rows[y] && span[n - 1].x + span[n - 1].w == cx) {
+				span[n - 1].w++;
+			} else {
+				span[n].x = cx;
+				span[n].w = 1;
+				n++;
+			}
+		}
+	}
+	rows[box.h] = n;
+
+	return glyph;
+}
+
+struct glyph *get_glyph (SDL_Surface *img, SDL_Rect block)
+{
+	Uint8 *p;
+	Uint8 r, g, b;
+
+	int pitch = (block.w + 7) / 8;
+	unsigned char *ink = calloc(block.h, pitch);
+
+	if (!ink) {
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Could not load glyph.\n");
+		return NULL;
+	}
+
+	// Extents are collected as lo_x, lo_y, hi_x, hi_y
+	SDL_Rect box = {block.w, block.h, -1, -1};
+	unsigned char inside;
+	int num_spans = 0;
+
+	for (int y = 0; y < block.h; y++) {
+		p = img->pixels +
+		    (y + block.y) * img->pitch +
+		    block.x * BYTES_PER_PIXEL;
+		inside = 0;
+		for (int x = 0; x < block.w; x++) {
+			SDL_GetRGB(*((Uint32 *)p),
+			           img->format,
+			           &r, &g, &b);
+			if (r + g + b >= 0xff) {
+				inside = 0;
+			} else {
+				ink[y * pitch + x / 8] |= 0x80 >> (x & 7);
+				if (!inside) num_spans++;
+				inside = 1;
+				if (x < box.x) box.x = x;
+				if (x > box.w) box.w = x;
+				if (y < box.y) box.y = y;
+				box.h = y;
+			}
+			p += BYTES_PER_PIXEL;
+		}
+	}
+
+	struct glyph *glyph = NULL;
+
+	if (box.h >= 0) {
+		box.w -= box.x - 1;
+		box.h -= box.y - 1;
+		glyph = new_glyph(ink, pitch, box, num_spans);
+	}
+
+	free(ink);
+
+	return glyph;
+}
+
+Uint64 hash_bytes (unsigned char *p, size_t len)
+{
+	Uint64 hash = 0xcbf29ce484222325;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
+
+unsigned char *font_cache_path (unsigned char *path)
+{
+	unsigned char *cache_path = malloc(strlen(path) +
+	                                   sizeof(FONT_CACHE_EXT));
+
+	if (cache_path) {
+		strcpy(cache_path, path);
+		strcat(cache_path, FONT_CACHE_EXT);
+	}
+
+	return cache_path;
+}
+
+unsigned char *read_file (unsigned char *path, size_t *len_p)
+{
+	FILE *f = fopen(path, "rb");
+	unsigned char *data = NULL;
+	long len;
+
+	if (!f) return NULL;
+
+	if (!fseek(f, 0, SEEK_END) &&
+	    (len = ftell(f)) > 0 &&
+	    !fseek(f, 0, SEEK_SET) &&
+	    (data = malloc(len))) {
+		if (fread(data, 1, len, f) == len) {
+			*len_p = len;
+		} else {
+			free(data);
+			data = NULL;
+		}
+	}
+
+	fclose(f);
+
+	return data;
+}
+
+// The glyph at offset at of a mapped cache must lie inside the file and
+// only ink inside the cell, since blit_glyph trusts both. Sums are done
+// in 64 bits so a corrupt field cannot wrap past a check.
+int check_cache_glyph (struct font_cache *cache, Uint32 at)
+{
+	struct glyph *glyph = (struct glyph *) ((Uint8 *) cache + at);
+	Uint16 *rows;
+	struct span *span;
+
+	if (at < sizeof(struct font_cache) ||
+	    at % 8 ||
+	    (Uint64) at + sizeof(struct glyph) > cache->size ||
+	    (Uint64) at + glyph->size > cache->size ||
+	    glyph->spans < sizeof(struct glyph) +
+	                   (glyph->h + 1) * sizeof(Uint16) ||
+	    (Uint64) glyph->spans + glyph->num_spans * sizeof(struct span) >
+	    glyph->bits ||
+	    (Uint64) glyph->bits + (Uint64) glyph->h * glyph->pitch >
+	    glyph->size ||
+	    (Uint64) glyph->y + glyph->h > cache->h)
+		return 0;
+
+	rows = glyph_rows(glyph);
+	span = glyph_spans(glyph);
+	if (rows[0] || rows[glyph->h] != glyph->num_spans)
+		return 0;
+	for (int y = 0; y < glyph->h; y++) {
+		if (rows[y] > rows[y + 1])
+			return 0;
+	}
+	for (int s = 0; s < glyph->num_spans; s++) {
+		if ((Uint64) span[s].x + span[s].w > cache->w)
+			return 0;
+	}
+
+	return 1;
+}
+
+// Map a cache written by save_font_cache. The glyph records are used in
+// place, so every process loading the same font shares the pages.
+struct font *load_font_cache (unsigned char *cache_path, Uint64 src_size, Uint64 src_hash)
+{
+	int fd = open(cache_path, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0) return NULL;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(struct font_cache)) {
+		close(fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	struct font_cache *cache = map;
+
+	if (memcmp(cache->magic, "SYF", 3) ||
+	    cache->magic[3] != FONT_CACHE_VERSION ||
+	    cache->size != st.st_size ||
+	    cache->src_size != src_size ||
+	    cache->src_hash != src_hash ||
+	    !cache->w || !cache->h) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	for (unsigned i = 0; i < 256; i++) {
+		if (cache->glyph[i] && !check_cache_glyph(cache, cache->glyph[i])) {
+			munmap(map, st.st_size);
+			return NULL;
+		}
+	}
+
+	struct font *font = malloc(sizeof(struct font));
+
+	if (!font) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	font->ref = 1;
+	font->w = cache->w;
+	font->h = cache->h;
+	font->map = map;
+	font->map_len = st.st_size;
+	font->img = NULL;
+
+	for (unsigned i = 0; i < 256; i++) {
+		font->glyph[i] = cache->glyph[i] ?
+		                 map + cache->glyph[i] :
+		                 NULL;
+		atomic_init(&font->loaded[i], 1);
+	}
+
+	return font;
+}
+
+int save_font_cache (struct font *font, unsigned char *cache_path, Uint64 src_size, Uint64 src_hash)
+{
+	struct font_cache cache = {{'S', 'Y', 'F', FONT_CACHE_VERSION}};
+	Uint32 at = sizeof(struct font_cache);
+
+	cache.w = font->w;
+	cache.h = font->h;
+	cache.src_size = src_size;
+	cache.src_hash = src_hash;
+
+	for (unsigned i = 0; i < 256; i++) {
+		if (font->glyph[i]) {
+			cache.glyph[i] = at;
+			at += font->glyph[i]->size;
+		} else cache.glyph[i] = 0;
+	}
+	cache.size = at;
+
+	// Write beside the real name and rename, so readers never map a
+	// half written cache.
+	unsigned char tmp_path[strlen(cache_path) + 16];
+	sprintf(tmp_path, "%s.%i", cache_path, (int) getpid());
+
+	FILE *f = fopen(tmp_path, "wb");
+
+	if (!f) return 0;
+
+	int ok = fwrite(&cache, sizeof(struct font_cache), 1, f) == 1;
+
+	for (unsigned i = 0; ok && i < 256; i++) {
+		if (font->glyph[i])
+			ok = fwrite(font->glyph[i],
+			            font->glyph[i]->size,
+			            1,
+			            f) == 1;
+	}
+
+	if (fclose(f) || !ok || rename(tmp_path, cache_path)) {
+		remove(tmp_path);
+		return 0;
+	}
+
+	return 1;
+}
+
+void load_glyph (struct font *font, unsigned char i)
+{
+	SDL_Rect block = {(i % 16) * font->img->w / 16,
+	                  (i / 16) * font->img->h / 16,
+	                  font->w,
+	                  font->h};
+
+	font->glyph[i] = get_glyph(font->img, block);
+	atomic_store_explicit(&font->loaded[i], 1, memory_order_release);
+}
+
+void load_glyph_row (void *params, int row)
+{
+	for (int i = 0; i < 16; i++)
+		load_glyph(params, i + row * 16);
+}
+
+struct glyph *font_glyph (struct font *font, unsigned char i)
+{
+	if (atomic_load_explicit(&font->loaded[i], memory_order_acquire))
+		return font->glyph[i];
+
+	pthread_mutex_lock(&font->lock);
+	if (!atomic_load_explicit(&font->loaded[i], memory_order_relaxed))
+		load_glyph(font, i);
+	pthread_mutex_unlock(&font->lock);
+
+	return font->glyph[i];
+}
+
+struct font *load_font (unsigned char *path)
+{
+	if (!path) {
+		fprintf(stderr,
+		        "Path not given.\n"
+		        "Could not load font.\n");
+		return NULL;
+	}
+
+	size_t src_size = 0;
+	unsigned char *src = read_file(path, &src_size);
+
+	if (!src) {
+		fprintf(stderr,
+		        "Error reading file '%s'.\n"
+		        "Could not load font.\n",
+		        path);
+		return NULL;
+	}
+
+	Uint64 src_hash = hash_bytes(src, src_size);
+	unsigned char *cache_path = font_cache_path(path);
+	struct font *font = NULL;
+
+	if (cache_path && !(font_mode & FONT_NO_CACHE))
+		font = load_font_cache(cache_path, src_size, src_hash);
+
+	if (font) {
+		font->hash = src_hash;
+		free(cache_path);
+		free(src);
+		return font;
+	}
+
+	SDL_Surface *img = IMG_Load_RW(SDL_RWFromConstMem(src, src_size), 1);
+
+	if (!img) {
+		fprintf(stderr,
+		        "Error loading image '%s'.\n"
+		        "IMG_Error: %s\n",
+		        path,
+		        IMG_GetError());
+		free(cache_path);
+		free(src);
+		return NULL;
+	}
+
+	font = malloc(sizeof(struct font));
+
+	if (!font) {
+		SDL_FreeSurface(img);
+		free(cache_path);
+		free(src);
+		fprintf(stderr,
+		        "Error allocating memory.\n"
+		        "Could not load font '%s'.\n",
+		        path);
+		return NULL;
+	}
+
+	font->ref = 1;
+	font->hash = src_hash;
+	font->w = img->w / 16;
+	font->h = img->h / 16;
+	font->map = NULL;
+	font->map_len = 0;
+
+	if (!font->w || !font->h) {
+		fprintf(stderr,
+		        "Glyphs are too small.\n"
+		        "Could not load font '%s'.\n",
+		        path);
+		SDL_FreeSurface(img);
+		free(cache_path);
+		free(src);
+		free(font);
+		return NULL;
+	}
+
+	font->img = img;
+	pthread_mutex_init(&font->lock, NULL);
+
+	for (unsigned i = 0; i < 256; i++) {
+		font->glyph[i] = NULL;
+		atomic_init(&font->loaded[i], 0);
+	}
+
+	if ((font_mode & FONT_LOAD_MASK) == FONT_LAZY) {
+		// Glyphs are decoded by font_glyph as strokes need them, and
+		// the cache is left for an eager load to write.
+		free(cache_path);
+		free(src);
+		return font;
+	}
+
+	if ((font_mode & FONT_LOAD_MASK) == FONT_PARALLEL) {
+		pool_run(16, load_glyph_row, font);
+	} else for (int j = 0; j < 16; j++)
+		load_glyph_row(font, j);
+
+	font->img = NULL;
+	SDL_FreeSurface(img);
+
+	if (cache_path &&
+	    !(font_mode & FONT_NO_CACHE) &&
+	    !save_font_cache(font, cache_path, src_size, src_hash))
+		fprintf(stderr,
+		        "Error writing '%s'.\n"
+		        "Could not cache font '%s'.\n",
+		        cache_path,
+		        path);
+
+	free(cache_path);
+	free(src);
+
+	return font;
+}
+
+struct font *copy_font (struct font *font)
+{
+	if (font) font->ref += 1;
+	return font;
+}
+
+void destroy_font (struct font **font_p)
+{
+	struct font *font = *font_p;
+	if (!font) return;
+
+	*font_p = NULL;
+
+	font->ref -= 1;
+	if (font->ref)
+		return;
+	if (font->img)
+		SDL_FreeSurface(font->img);
+	if (font->map) {
+		munmap(font->map, font->map_len);
+	} else {
+		for (unsigned i = 0; i < 256; i++) {
+			if (font->glyph[i])
+				free(font->glyph[i]);
+		}
+		pthread_mutex_destroy(&font->lock);
+	}
+	free(font);
+}
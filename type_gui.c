@@ -10,6 +10,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <ctype.h>
 #include <math.h>
 #include "type.h"
@@ -45,10 +46,11 @@
 
 #define BLINK_TIME 500
 
+#define ticks_until(t) ((Sint32) ((t) - SDL_GetTicks()))
+
 SDL_Window *window;
 SDL_Renderer *renderer;
 
-SDL_Texture *texture;
 Uint32 texture_format;
 int texture_access;
 int texture_w;
@@ -58,6 +60,22 @@ SDL_Rect frame;
 SDL_Rect cursor;
 SDL_Color cursor_rgb;
 
+char vsync = 1;
+unsigned frame_cap = 0;
+
+Uint32 wake_event = (Uint32) -1;
+atomic_char wake_pending = 0;
+
+// Selections, the cursor, the margin and tab stops are all flat quads,
+// clipped to the window and sent in one SDL_RenderGeometry call.
+struct overlay {
+	SDL_Rect clip;
+	int len;
+	int size;
+	SDL_Vertex *vertex;
+	int *index;
+} overlay;
+
 int gui_cleanup ()
 {
 	if (renderer)
@@ -97,7 +115,8 @@ int gui_init ()
 
 	renderer = SDL_CreateRenderer(window,
 	                              -1,
-	                              SDL_RENDERER_ACCELERATED);
+	                              SDL_RENDERER_ACCELERATED |
+	                              (vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
 
 	if (!renderer) {
 		fprintf(stderr,
@@ -110,11 +129,121 @@ int gui_init ()
 	SDL_SetRenderDrawBlendMode(renderer,
 	                           SDL_BLENDMODE_BLEND);
 
+	wake_event = SDL_RegisterEvents(1);
+
 	return 1;
 }
 
+void overlay_rect (SDL_Rect rect, SDL_Color color)
+{
+	SDL_Vertex *vertex;
+	int *index;
+	int size;
+
+	if (!SDL_IntersectRect(&rect, &overlay.clip, &rect))
+		return;
+
+	if (overlay.len == overlay.size) {
+		size = overlay.size ? 2 * overlay.size : 64;
+		vertex = realloc(overlay.vertex, 4 * size * sizeof(SDL_Vertex));
+		if (vertex)
+			overlay.vertex = vertex;
+		index = realloc(overlay.index, 6 * size * sizeof(int));
+		if (index)
+			overlay.index = index;
+		if (!vertex || !index)
+			return;
+		overlay.size = size;
+	}
+
+	vertex = overlay.vertex + 4 * overlay.len;
+	index = overlay.index + 6 * overlay.len;
+	for (int i = 0; i < 4; i++) {
+		vertex[i].position.x = rect.x + (i == 1 || i == 2 ? rect.w : 0);
+		vertex[i].position.y = rect.y + (i >= 2 ? rect.h : 0);
+		vertex[i].color = color;
+		vertex[i].tex_coord.x = 0;
+		vertex[i].tex_coord.y = 0;
+	}
+	index[0] = 4 * overlay.len;
+	index[1] = 4 * overlay.len + 1;
+	index[2] = 4 * overlay.len + 2;
+	index[3] = 4 * overlay.len + 2;
+	index[4] = 4 * overlay.len + 3;
+	index[5] = 4 * overlay.len;
+	overlay.len++;
+}
+
+// The outline SDL_RenderDrawRect would draw.
+void overlay_outline (SDL_Rect rect, SDL_Color color)
+{
+	SDL_Rect side = rect;
+
+	side.h = 1;
+	overlay_rect(side, color);
+	side.y = rect.y + rect.h - 1;
+	overlay_rect(side, color);
+	side.y = rect.y + 1;
+	side.w = 1;
+	side.h = rect.h - 2;
+	overlay_rect(side, color);
+	side.x = rect.x + rect.w - 1;
+	overlay_rect(side, color);
+}
+
+// Only the tab stops inside the window are looked at.
+void overlay_tabs ()
+{
+	SDL_Color color = {TAB_R, TAB_G, TAB_B, TAB_A};
+	struct tabs *tabs;
+	SDL_Rect line;
+	double step;
+	int at;
+
+	tabs = &curbuf->h_tab;
+	step = curbuf->cam_z * (double) curbuf->doc.font->w;
+	at = (int) floor((double) (overlay.clip.x - frame.x) / step);
+	line.y = frame.y;
+	line.w = 1;
+	line.h = frame.h + 1;
+	for (int i = find_tab(tabs, at > 0 ? at : 0); i < tabs->len; i++) {
+		line.x = frame.x + (int) floor(step * (double) tabs->at[i]);
+		if (line.x >= overlay.clip.x + overlay.clip.w)
+			break;
+		overlay_rect(line, color);
+	}
+
+	tabs = &curbuf->v_tab;
+	step = curbuf->cam_z * (double) curbuf->doc.font->h / 2.0;
+	at = (int) floor((double) (overlay.clip.y - frame.y) / step);
+	line.x = frame.x;
+	line.w = frame.w + 1;
+	line.h = 1;
+	for (int i = find_tab(tabs, at > 0 ? at : 0); i < tabs->len; i++) {
+		line.y = frame.y + (int) floor(step * (double) tabs->at[i]);
+		if (line.y >= overlay.clip.y + overlay.clip.h)
+			break;
+		overlay_rect(line, color);
+	}
+}
+
+void overlay_flush ()
+{
+	if (overlay.len) {
+		SDL_RenderGeometry(renderer,
+		                   NULL,
+		                   overlay.vertex,
+		                   4 * overlay.len,
+		                   overlay.index,
+		                   6 * overlay.len);
+	}
+	overlay.len = 0;
+}
+
 void gui_draw (unsigned char blink)
 {
+	SDL_Surface *screen = SDL_GetWindowSurface(window);
+
 	SDL_SetRenderDrawColor(renderer,
 	                       BACKGROUND_R,
 	                       BACKGROUND_G,
@@ -122,77 +251,83 @@ void gui_draw (unsigned char blink)
 	                       BACKGROUND_A);
 	SDL_RenderClear(renderer);
 
-	if (texture) {
+	if (curbuf) {
 		SDL_SetRenderDrawColor(renderer,
 		                       DOC_R,
 		                       DOC_G,
 		                       DOC_B,
 		                       DOC_A);
 		SDL_RenderFillRect(renderer, &frame);
-		SDL_RenderCopy(renderer, texture, NULL, &frame);
+		show_doc(&curbuf->doc, &frame);
+
+		overlay.clip.x = 0;
+		overlay.clip.y = 0;
+		overlay.clip.w = screen->w;
+		overlay.clip.h = screen->h;
 
-		SDL_SetRenderDrawColor(renderer,
-		                       SELECT_R,
-		                       SELECT_G,
-		                       SELECT_B,
-		                       SELECT_A);
 		for (struct select *select = curbuf->select;
 		     select;
 		     select = select->next) {
-			SDL_RenderFillRect(renderer, &select->rect);
+			overlay_rect(select->rect,
+			             (SDL_Color) {SELECT_R, SELECT_G, SELECT_B, SELECT_A});
 		}
 
 		if (blink) {
 			if (mode & CLIP_ON) {
-				SDL_RenderCopy(renderer,
-				               clipboard.texture,
-				               NULL,
-				               &cursor);
-			} else {
-				SDL_SetRenderDrawColor(renderer,
-				                       cursor_rgb.r,
-				                       cursor_rgb.g,
-				                       cursor_rgb.b,
-				                       0xff);
-				SDL_RenderFillRect(renderer, &cursor);
-			}
+				overlay_flush();
+				show_doc(&clipboard, &cursor);
+			} else overlay_rect(cursor,
+			                    (SDL_Color) {cursor_rgb.r,
+			                                 cursor_rgb.g,
+			                                 cursor_rgb.b,
+			                                 0xff});
 		}
 
-		SDL_SetRenderDrawColor(renderer,
-		                       MARGIN_R,
-		                       MARGIN_G,
-		                       MARGIN_B,
-		                       MARGIN_A);
-		SDL_RenderDrawRect(renderer, &curbuf->margin);
-
-		SDL_SetRenderDrawColor(renderer,
-		                       TAB_R,
-		                       TAB_G,
-		                       TAB_B,
-		                       TAB_A);
-		for (int i = 0; i < curbuf->doc.rows; i++) {
-			if (curbuf->v_tab[i]) {
-				SDL_RenderDrawLine(renderer,
-				                   frame.x,
-				                   curbuf->v_tab[i],
-				                   frame.x + frame.w,
-				                   curbuf->v_tab[i]);
-			}
-		}
-		for (int i = 0; i < curbuf->doc.cols; i++) {
-			if (curbuf->h_tab[i]) {
-				SDL_RenderDrawLine(renderer,
-				                   curbuf->h_tab[i],
-				                   frame.y,
-				                   curbuf->h_tab[i],
-				                   frame.y + frame.h);
-			}
-		}
+		overlay_outline(curbuf->margin,
+		                (SDL_Color) {MARGIN_R, MARGIN_G, MARGIN_B, MARGIN_A});
+		overlay_tabs();
+		overlay_flush();
 	}
 
 	SDL_RenderPresent(renderer);
 }
 
+// Safe to call from any thread. Only one wake event is queued at a time;
+// the flag is cleared just before the GUI drains the stream.
+void gui_wake ()
+{
+	SDL_Event e = {0};
+
+	if (wake_event == (Uint32) -1 || atomic_exchange(&wake_pending, 1))
+		return;
+
+	e.type = wake_event;
+	if (SDL_PushEvent(&e) <= 0)
+		atomic_store(&wake_pending, 0);
+}
+
+// Returns 1 if the event changed what is on screen.
+int gui_event (SDL_Event *e)
+{
+	switch (e->type) {
+		case SDL_QUIT:
+			run = 0;
+			return 0;
+		case SDL_KEYDOWN:
+			handle_keypress(SDL_GetModState(),
+			                e->key.keysym.sym);
+			return 0;
+		case SDL_WINDOWEVENT:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Sleeps until input, control data or the next deadline: the cursor
+// blink, or with a frame cap the earliest time the next frame may go up.
+// Frames are only drawn and presented when something changed. While
+// control input keeps coming the loop polls instead of sleeping.
 void gui_loop ()
 {
 	if (!gui_init()) {
@@ -203,31 +338,53 @@ void gui_loop ()
 	choose_buffer(allbuf);
 	zoom_to_fit(allbuf);
 
-	Uint32 ticks = SDL_GetTicks();
-	Uint32 newticks;
-	unsigned char blink;
+	Uint32 blink_at = SDL_GetTicks() + BLINK_TIME;
+	Uint32 frame_at = SDL_GetTicks();
+	unsigned char blink = 1;
+	char dirty = 1;
+	char busy;
+	Sint32 timeout;
 
 	SDL_Event e;
 
 	while (run) {
-		newticks = SDL_GetTicks();
-		if (newticks > ticks + BLINK_TIME) {
-			ticks = newticks;
+		if (ticks_until(blink_at) <= 0) {
+			blink_at = SDL_GetTicks() + BLINK_TIME;
 			blink = 1 - blink;
+			dirty = 1;
 		}
 
-		gui_draw(blink);
-
-		while (SDL_PollEvent(&e) != 0) {
-			if (e.type == SDL_QUIT) {
-				run = 0;
-			} else if (e.type == SDL_KEYDOWN) {
-				handle_keypress(SDL_GetModState(),
-				                e.key.keysym.sym);
-			}
+		atomic_store(&wake_pending, 0);
+		busy = control_handle(curbuf);
+		if (busy)
+			dirty = 1;
+
+		if (dirty && ticks_until(frame_at) <= 0) {
+			flush_uploads();
+			gui_draw(blink);
+			dirty = 0;
+			if (frame_cap)
+				frame_at = SDL_GetTicks() + 1000 / frame_cap;
 		}
 
-		control_handle(curbuf);
+		if (!run)
+			break;
+
+		timeout = ticks_until(blink_at);
+		if (dirty && ticks_until(frame_at) < timeout)
+			timeout = ticks_until(frame_at);
+		// Control input may be left over after the per-pass budget;
+		// only sleep once a pass finds none.
+		if (busy)
+			timeout = 0;
+
+		if (timeout > 0 ? SDL_WaitEventTimeout(&e, timeout)
+		                : SDL_PollEvent(&e)) {
+			do {
+				if (gui_event(&e))
+					dirty = 1;
+			} while (SDL_PollEvent(&e));
+		}
 	}
 
 	gui_cleanup();
@@ -10,6 +10,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <ctype.h>
 #include <math.h>
 #include "type.h"
@@ -42,6 +43,17 @@ void do_type (struct buffer *buf, unsigned char glyph)
 	do_absmove(buf, buf->ptr_col + 1, buf->ptr_row);
 }
 
+void do_place (struct buffer *buf, int col, int row, unsigned char color, unsigned char glyph)
+{
+	if (color < buf->doc.palette->num_colors)
+		add_stroke(buf->doc, col, row, color, glyph);
+}
+
+void do_clear (struct buffer *buf, int col, int row, int cols, int rows)
+{
+	clear_rect(buf->doc, col, row, cols, rows);
+}
+
 void do_test (struct buffer *buf, int a, int b, int c)
 {
 	printf("%i %i %i\n", a, b, c);
@@ -0,0 +1,208 @@
+#include <SDL2/SDL_image.h>
+#include <SDL2/SDL.h>
+#include <X11/Xlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ctype.h>
+#include <math.h>
+#include "type.h"
+
+#define POOL_MAX_THREADS 16
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t idle;
+	pthread_mutex_t run_lock;
+	int num_threads;
+	pthread_t thread[POOL_MAX_THREADS];
+	unsigned generation;
+	int busy;
+	char quit;
+
+	void (*fn) (void *arg, int i);
+	void *arg;
+	// What is left of each thread's share of [0, n), begin in the high
+	// half and end in the low. The caller has the last slot.
+	_Atomic Uint64 range[POOL_MAX_THREADS + 1];
+};
+
+struct pool pool;
+_Thread_local char in_pool = 0;
+
+#define RANGE(begin, end) ((Uint64) (begin) << 32 | (Uint32) (end))
+#define RANGE_BEGIN(r) ((int) ((r) >> 32))
+#define RANGE_END(r) ((int) (Uint32) (r))
+
+// Take the first index left in a slot, -1 once it is empty.
+int pool_take (int slot)
+{
+	Uint64 r = atomic_load(&pool.range[slot]);
+
+	while (RANGE_BEGIN(r) < RANGE_END(r)) {
+		if (atomic_compare_exchange_weak(&pool.range[slot], &r,
+		                                 RANGE(RANGE_BEGIN(r) + 1,
+		                                       RANGE_END(r))))
+			return RANGE_BEGIN(r);
+	}
+
+	return -1;
+}
+
+// Move the back half of the first slot that has work left into our own,
+// which is empty. Owners take from the front, so the two only meet on
+// the last index.
+int pool_steal (int slot)
+{
+	int slots = pool.num_threads + 1;
+	int victim;
+	int half;
+	Uint64 r;
+
+	for (int k = 1; k < slots; k++) {
+		victim = (slot + k) % slots;
+		r = atomic_load(&pool.range[victim]);
+		while (RANGE_BEGIN(r) < RANGE_END(r)) {
+			half = (RANGE_END(r) - RANGE_BEGIN(r) + 1) / 2;
+			if (atomic_compare_exchange_weak(&pool.range[victim], &r,
+			                                 RANGE(RANGE_BEGIN(r),
+			                                       RANGE_END(r) - half))) {
+				atomic_store(&pool.range[slot],
+				             RANGE(RANGE_END(r) - half, RANGE_END(r)));
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Work through our own share, then keep stealing until every slot is
+// empty. Each thread runs a contiguous stretch of jobs for as long as it
+// can, so neighbouring tiles stay on one core.
+void pool_work (int slot)
+{
+	int i;
+
+	do {
+		while ((i = pool_take(slot)) >= 0)
+			pool.fn(pool.arg, i);
+	} while (pool_steal(slot));
+}
+
+void *pool_loop (void *params)
+{
+	int slot = (intptr_t) params;
+	unsigned seen = 0;
+
+	in_pool = 1;
+
+	pthread_mutex_lock(&pool.lock);
+	while (1) {
+		while (!pool.quit && pool.generation == seen)
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		if (pool.quit)
+			break;
+		seen = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+
+		pool_work(slot);
+
+		pthread_mutex_lock(&pool.lock);
+		if (!--pool.busy)
+			pthread_cond_signal(&pool.idle);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+void init_pool ()
+{
+	int n = SDL_GetCPUCount() - 1;
+
+	if (n > POOL_MAX_THREADS)
+		n = POOL_MAX_THREADS;
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_mutex_init(&pool.run_lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+	pthread_cond_init(&pool.idle, NULL);
+	pool.num_threads = 0;
+	pool.generation = 0;
+	pool.busy = 0;
+	pool.quit = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (pthread_create(&pool.thread[i], NULL, pool_loop,
+		                   (void *) (intptr_t) i)) {
+			fprintf(stderr,
+			        "Error creating thread.\n"
+			        "Thread pool has %i workers.\n",
+			        i);
+			break;
+		}
+		pool.num_threads++;
+	}
+}
+
+void cleanup_pool ()
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = 1;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (int i = 0; i < pool.num_threads; i++)
+		pthread_join(pool.thread[i], NULL);
+	pool.num_threads = 0;
+}
+
+// Call fn(arg, i) for every i in [0, n) across the pool and wait for all
+// of them. Each thread starts on an equal share and steals from the
+// others when it runs out. The calling thread takes part, and calls made
+// from inside a job run inline.
+void pool_run (int n, void (*fn) (void *arg, int i), void *arg)
+{
+	int slots = pool.num_threads + 1;
+
+	if (in_pool || pool.num_threads == 0 || n < 2) {
+		for (int i = 0; i < n; i++)
+			fn(arg, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.run_lock);
+	in_pool = 1;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.arg = arg;
+	for (int slot = 0; slot < slots; slot++) {
+		atomic_store(&pool.range[slot],
+		             RANGE((Uint64) n * slot / slots,
+		                   (Uint64) n * (slot + 1) / slots));
+	}
+	pool.busy = pool.num_threads;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+
+	pool_work(pool.num_threads);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.busy)
+		pthread_cond_wait(&pool.idle, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+
+	in_pool = 0;
+	pthread_mutex_unlock(&pool.run_lock);
+}
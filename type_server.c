@@ -0,0 +1,424 @@
+#include <SDL2/SDL_image.h>
+#include <SDL2/SDL.h>
+#include <X11/Xlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ctype.h>
+#include <math.h>
+#include "type.h"
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CLIENT_UNSENT_SIZE 4096
+#define SERVER_BUF_SIZE (1 << 16)
+#define SERVER_EVENTS 16
+
+#define TAG_LISTEN MAX_CLIENTS
+#define TAG_WAKE (MAX_CLIENTS + 1)
+#define TAG_STOP (MAX_CLIENTS + 2)
+
+#define ring_used(ring) (atomic_load(&(ring)->tail) - atomic_load(&(ring)->head))
+
+unsigned char *sock_path = "/tmp/synthotype.sock";
+struct client client[MAX_CLIENTS];
+struct client *replying;
+int server_event = -1;
+int epoll_fd = -1;
+int next_client = 0;
+unsigned char *server_buf;
+char armed[MAX_CLIENTS];
+
+void init_server ()
+{
+	server_event = eventfd(0, EFD_CLOEXEC);
+}
+
+void free_client (struct client *client)
+{
+	destroy_ring(&client->in);
+	destroy_ring(&client->out);
+	destroy_chbuf(&client->pending);
+	free(client->unsent);
+	client->unsent = NULL;
+
+	atomic_store(&client->state, CLIENT_FREE);
+}
+
+void cleanup_server ()
+{
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (atomic_load(&client[i].state) != CLIENT_FREE)
+			free_client(&client[i]);
+	}
+
+	if (server_event >= 0)
+		close(server_event);
+	server_event = -1;
+}
+
+// Server thread. Takes a free slot; the GUI thread hands slots back once
+// it has parsed everything a closed client sent.
+struct client *new_client (int fd)
+{
+	struct client *c;
+
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		c = &client[i];
+		if (atomic_load(&c->state) != CLIENT_FREE)
+			continue;
+
+		c->in = new_ring(ring_size);
+		c->out = new_ring(ring_size);
+		c->pending = new_chbuf();
+		c->unsent = malloc(CLIENT_UNSENT_SIZE);
+
+		if (!c->in || !c->out || !c->pending || !c->unsent) {
+			free_client(c);
+			return NULL;
+		}
+
+		c->fd = fd;
+		c->unsent_at = 0;
+		c->unsent_len = 0;
+		c->buf = NULL;
+		c->ptr_col = 0;
+		c->ptr_row = 0;
+		atomic_store(&c->throttled, 0);
+		armed[i] = 0;
+		atomic_store(&c->state, CLIENT_OPEN);
+
+		return c;
+	}
+
+	fprintf(stderr,
+	        "Too many clients.\n"
+	        "Connection refused.\n");
+
+	return NULL;
+}
+
+// A throttled client is taken out of the epoll set altogether, since a
+// hung up socket would otherwise report EPOLLHUP until its ring drains.
+void arm_client (struct client *c)
+{
+	struct epoll_event ev = {0};
+	int i = c - client;
+
+	if (atomic_load(&c->throttled)) {
+		if (armed[i])
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+		armed[i] = 0;
+		return;
+	}
+
+	ev.events = EPOLLIN | (c->unsent_len ? EPOLLOUT : 0);
+	ev.data.u32 = i;
+	epoll_ctl(epoll_fd, armed[i] ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev);
+	armed[i] = 1;
+}
+
+void close_client (struct client *c)
+{
+	if (armed[c - client])
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	armed[c - client] = 0;
+	close(c->fd);
+	c->fd = -1;
+
+	atomic_store(&c->state, CLIENT_CLOSED);
+	gui_wake();
+}
+
+// Read while the client's ring has room. A full ring stops reads from
+// the socket until the GUI catches up, which holds the writer back.
+void read_client (struct client *c)
+{
+	char was_throttled = atomic_exchange(&c->throttled, 0);
+	size_t space;
+	ssize_t n;
+
+	while (1) {
+		space = c->in->size - ring_used(c->in);
+		if (!space) {
+			atomic_store(&c->throttled, 1);
+			// The GUI may have drained the ring before seeing the flag.
+			if (ring_used(c->in) == c->in->size) {
+				arm_client(c);
+				return;
+			}
+			atomic_store(&c->throttled, 0);
+			continue;
+		}
+
+		n = read(c->fd, server_buf, space < SERVER_BUF_SIZE ? space : SERVER_BUF_SIZE);
+		if (n > 0) {
+			ring_write(c->in, server_buf, n);
+			gui_wake();
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && errno == EAGAIN) {
+			break;
+		} else {
+			close_client(c);
+			return;
+		}
+	}
+
+	if (was_throttled)
+		arm_client(c);
+}
+
+// Send queued replies. Returns 0 if the client went away.
+int write_client (struct client *c)
+{
+	size_t had = c->unsent_len;
+	ssize_t n;
+
+	while (1) {
+		if (!c->unsent_len) {
+			c->unsent_at = 0;
+			c->unsent_len = ring_read(c->out, c->unsent, CLIENT_UNSENT_SIZE);
+			if (!c->unsent_len)
+				break;
+		}
+
+		n = send(c->fd, c->unsent + c->unsent_at, c->unsent_len, MSG_NOSIGNAL);
+		if (n > 0) {
+			c->unsent_at += n;
+			c->unsent_len -= n;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && errno == EAGAIN) {
+			break;
+		} else {
+			close_client(c);
+			return 0;
+		}
+	}
+
+	if (!had != !c->unsent_len)
+		arm_client(c);
+
+	return 1;
+}
+
+void accept_clients (int listen_fd)
+{
+	struct client *c;
+	int fd;
+
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		if ((c = new_client(fd))) {
+			arm_client(c);
+		} else close(fd);
+	}
+}
+
+int open_server ()
+{
+	struct sockaddr_un addr = {AF_UNIX};
+	struct epoll_event ev = {EPOLLIN};
+	int fd;
+
+	if (strlen(sock_path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, sock_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	unlink(sock_path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(fd, SOMAXCONN) ||
+	    (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	ev.data.u32 = TAG_LISTEN;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	ev.data.u32 = TAG_WAKE;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_event, &ev);
+	ev.data.u32 = TAG_STOP;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_event, &ev);
+
+	return fd;
+}
+
+// Accepts clients on sock_path and moves bytes between their sockets and
+// rings. server_event means the GUI consumed input or queued replies.
+void *server_loop (void *params)
+{
+	struct epoll_event ev[SERVER_EVENTS];
+	struct client *c;
+	eventfd_t count;
+	char stop = 0;
+	int listen_fd;
+	int n;
+
+	if (!sock_path[0])
+		return NULL;
+
+	server_buf = malloc(SERVER_BUF_SIZE);
+	listen_fd = server_buf ? open_server() : -1;
+
+	if (listen_fd < 0) {
+		fprintf(stderr,
+		        "Could not listen on %s.\n"
+		        "Socket server is disabled.\n",
+		        sock_path);
+		free(server_buf);
+		return NULL;
+	}
+
+	while (!stop) {
+		n = epoll_wait(epoll_fd, ev, SERVER_EVENTS, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+
+		for (int i = 0; i < n; i++) {
+			if (ev[i].data.u32 == TAG_STOP) {
+				stop = 1;
+			} else if (ev[i].data.u32 == TAG_LISTEN) {
+				accept_clients(listen_fd);
+			} else if (ev[i].data.u32 == TAG_WAKE) {
+				eventfd_read(server_event, &count);
+				for (int k = 0; k < MAX_CLIENTS; k++) {
+					c = &client[k];
+					if (atomic_load(&c->state) != CLIENT_OPEN)
+						continue;
+					if (atomic_load(&c->throttled))
+						read_client(c);
+					if (atomic_load(&c->state) == CLIENT_OPEN)
+						write_client(c);
+				}
+			} else {
+				c = &client[ev[i].data.u32];
+				if (atomic_load(&c->state) != CLIENT_OPEN)
+					continue;
+				if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					read_client(c);
+				if (atomic_load(&c->state) == CLIENT_OPEN &&
+				    ev[i].events & EPOLLOUT)
+					write_client(c);
+			}
+		}
+	}
+
+	for (int k = 0; k < MAX_CLIENTS; k++) {
+		if (atomic_load(&client[k].state) == CLIENT_OPEN)
+			close_client(&client[k]);
+	}
+
+	close(listen_fd);
+	close(epoll_fd);
+	epoll_fd = -1;
+	unlink(sock_path);
+	free(server_buf);
+
+	return NULL;
+}
+
+// GUI thread. Parses up to CTRL_QUANTUM bytes from one client with its
+// own cursor swapped into its buffer.
+int handle_client (struct client *c)
+{
+	struct buffer *buf;
+	size_t n;
+	int col, row;
+
+	if (!chbuf_reserve(c->pending, CTRL_QUANTUM))
+		return 0;
+
+	n = ring_read(c->in, c->pending->ch + c->pending->len, CTRL_QUANTUM);
+	if (!n)
+		return 0;
+	if (atomic_load(&c->throttled) && server_event >= 0)
+		eventfd_write(server_event, 1);
+
+	c->pending->len += n;
+	c->pending->ch[c->pending->len] = 0;
+
+	if (!c->buf) {
+		c->buf = curbuf;
+		c->ptr_col = curbuf->ptr_col;
+		c->ptr_row = curbuf->ptr_row;
+	}
+
+	buf = c->buf;
+	col = buf->ptr_col;
+	row = buf->ptr_row;
+	buf->ptr_col = c->ptr_col;
+	buf->ptr_row = c->ptr_row;
+
+	replying = c;
+	chbuf_handle(buf, c->pending);
+	replying = NULL;
+
+	c->ptr_col = buf->ptr_col;
+	c->ptr_row = buf->ptr_row;
+	buf->ptr_col = col;
+	buf->ptr_row = row;
+	if (buf == curbuf)
+		update_cursor();
+
+	return 1;
+}
+
+// One quantum per client per call, starting from a different client each
+// time, so a busy generator cannot starve the others.
+int server_handle ()
+{
+	struct client *c;
+	int handled = 0;
+	int state;
+
+	for (int k = 0; k < MAX_CLIENTS; k++) {
+		c = &client[(next_client + k) % MAX_CLIENTS];
+		state = atomic_load(&c->state);
+		if (state == CLIENT_FREE)
+			continue;
+		if (handle_client(c)) {
+			handled = 1;
+		} else if (state == CLIENT_CLOSED)
+			free_client(c);
+	}
+
+	next_client = (next_client + 1) % MAX_CLIENTS;
+
+	return handled;
+}
+
+// Route a reply to the client whose commands are running. Returns 0 if
+// the command came from somewhere else.
+int server_reply (unsigned char *str, size_t len)
+{
+	if (!replying)
+		return 0;
+
+	if (ring_write(replying->out, str, len) < len)
+		fprintf(stderr,
+		        "Client is not reading replies.\n"
+		        "Reply was dropped.\n");
+	if (server_event >= 0)
+		eventfd_write(server_event, 1);
+
+	return 1;
+}
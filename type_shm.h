@@ -0,0 +1,60 @@
+#ifndef SYNTHOTYPE_SHM_H
+#define SYNTHOTYPE_SHM_H
+
+// Shared memory command ring. The editor creates it with -m name; one
+// producer at a time opens it by name and writes commands in the same
+// format as the input FIFO. The data area is mapped twice back to back,
+// so a reservation never has to wrap.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SHM_RING_MAGIC 0x53594e52
+#define SHM_HEADER_SIZE 4096
+
+// Binary frames may be mixed with text commands on any transport:
+// ESC 'F', an op byte, the payload length as a little-endian u32, then
+// the payload. Coordinates are little-endian u16.
+//   FRAME_STROKES  (col, row, color, glyph) repeated, 6 bytes each
+//   FRAME_RUN      col, row, color, then one glyph per column
+//   FRAME_CLEAR    col, row, cols, rows
+#define FRAME_HEADER 7
+#define FRAME_MAX (1 << 20)
+#define FRAME_STROKES 1
+#define FRAME_RUN 2
+#define FRAME_CLEAR 3
+
+struct shm_header {
+	uint32_t magic;
+	uint32_t size;
+	atomic_int owner;
+
+	_Alignas(64) atomic_uint head;
+	atomic_uint producer_waiting;
+
+	_Alignas(64) atomic_uint tail;
+	atomic_uint consumer_waiting;
+	atomic_uint wake;
+};
+
+struct shm_ring {
+	struct shm_header *header;
+	unsigned char *data;
+	size_t size;
+	char *name;
+};
+
+struct shm_ring *shm_ring_create (const char *name, size_t size);
+void shm_ring_destroy (struct shm_ring **ring_p);
+
+struct shm_ring *shm_ring_open (const char *name);
+void *shm_ring_reserve (struct shm_ring *ring, size_t len);
+void shm_ring_commit (struct shm_ring *ring, size_t len);
+void shm_ring_write (struct shm_ring *ring, const void *src, size_t len);
+void shm_ring_close (struct shm_ring **ring_p);
+
+void shm_futex_wait (atomic_uint *addr, unsigned val);
+void shm_futex_wake (atomic_uint *addr);
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "type_shm.h"
+
+// Drives a running editor (started with -m NAME) through the input FIFO
+// and through the shared memory ring with the same payload, and times
+// each until the editor has parsed everything. Completion is detected
+// by a pointer query whose reply comes back on the output FIFO.
+
+#define BENCH_CHUNK (1 << 16)
+#define BENCH_QUERY "\033P\007"
+
+char *fifo_in = "/tmp/synthotype-in";
+char *fifo_out = "/tmp/synthotype-out";
+
+double now ()
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Commands the editor ignores, so the run measures transport and parsing
+// rather than rasterization. With -t, text that has to be drawn.
+void fill (unsigned char *dest, size_t len, char text)
+{
+	static const char noop[] = "\033X\007";
+
+	for (size_t i = 0; i < len; i++) {
+		if (text) {
+			dest[i] = i % 80 == 79 ? '\n' : 'a' + i % 26;
+		} else dest[i] = noop[i % 3];
+	}
+}
+
+int wait_reply (int fd)
+{
+	unsigned char ch;
+
+	while (read(fd, &ch, 1) == 1) {
+		if (ch == '\007')
+			return 1;
+	}
+
+	return 0;
+}
+
+double bench_fifo (int reply, size_t total, char text)
+{
+	unsigned char *buf = malloc(BENCH_CHUNK);
+	double start = now();
+	int fd = open(fifo_in, O_WRONLY);
+	size_t n;
+
+	if (!buf || fd < 0) {
+		fprintf(stderr,
+		        "Could not open %s.\n"
+		        "Is the editor running?\n",
+		        fifo_in);
+		exit(1);
+	}
+
+	for (size_t sent = 0; sent < total; sent += n) {
+		n = total - sent < BENCH_CHUNK - 1 ? total - sent : BENCH_CHUNK - 1;
+		fill(buf, n, text);
+		if (write(fd, buf, n) < 0)
+			break;
+	}
+	write(fd, BENCH_QUERY, 3);
+	close(fd);
+	wait_reply(reply);
+	free(buf);
+
+	return now() - start;
+}
+
+// Both paths generate every chunk afresh, as a real producer would; here
+// it goes straight into the ring and nothing is copied.
+double bench_shm (struct shm_ring *ring, int reply, size_t total, char text)
+{
+	double start = now();
+	size_t n;
+
+	for (size_t sent = 0; sent < total; sent += n) {
+		n = total - sent < BENCH_CHUNK - 1 ? total - sent : BENCH_CHUNK - 1;
+		fill(shm_ring_reserve(ring, n), n, text);
+		shm_ring_commit(ring, n);
+	}
+	shm_ring_write(ring, BENCH_QUERY, 3);
+	wait_reply(reply);
+
+	return now() - start;
+}
+
+int main (int argc, char **args)
+{
+	struct shm_ring *ring;
+	size_t megabytes = 64;
+	char text = 0;
+	int reply;
+	int opt;
+
+	while ((opt = getopt(argc, args, "n:t")) != -1) {
+		switch (opt) {
+			case 'n':
+				megabytes = strtoul(optarg, NULL, 0);
+				break;
+			case 't':
+				text = 1;
+				break;
+			default:
+				optind = argc + 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf(stderr,
+		        "Usage: %s [-n megabytes] [-t] shm-name\n",
+		        args[0]);
+		return 1;
+	}
+
+	ring = shm_ring_open(args[optind]);
+	reply = open(fifo_out, O_RDONLY | O_NONBLOCK);
+
+	if (!ring || reply < 0) {
+		fprintf(stderr,
+		        "Could not open %s.\n"
+		        "Start the editor with -m %s.\n",
+		        ring ? fifo_out : args[optind],
+		        args[optind]);
+		return 1;
+	}
+
+	// Drop stale replies, then block for ours.
+	while (read(reply, &opt, 1) == 1);
+	fcntl(reply, F_SETFL, 0);
+
+	// Whole three byte commands only; BENCH_CHUNK - 1 is a multiple of 3.
+	size_t total = (megabytes << 20) / 3 * 3;
+	double t_fifo = bench_fifo(reply, total, text);
+	double t_shm = bench_shm(ring, reply, total, text);
+
+	printf("fifo %8.1f MB/s\n", megabytes / t_fifo);
+	printf("shm  %8.1f MB/s %6.2fx\n", megabytes / t_shm, t_fifo / t_shm);
+
+	shm_ring_close(&ring);
+	close(reply);
+
+	return 0;
+}
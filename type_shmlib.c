@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "type_shm.h"
+
+// Producer library, kept free of SDL so generators can link it alone.
+
+void shm_futex_wait (atomic_uint *addr, unsigned val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+void shm_futex_wake (atomic_uint *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Map the data area twice in a row after a reserved hole, so bytes past
+// the end of the ring alias the start.
+unsigned char *map_mirror (int fd, size_t size)
+{
+	unsigned char *base = mmap(NULL, 2 * size, PROT_NONE,
+	                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (base == MAP_FAILED)
+		return NULL;
+
+	for (int i = 0; i < 2; i++) {
+		if (mmap(base + i * size, size, PROT_READ | PROT_WRITE,
+		         MAP_SHARED | MAP_FIXED, fd, SHM_HEADER_SIZE) == MAP_FAILED) {
+			munmap(base, 2 * size);
+			return NULL;
+		}
+	}
+
+	return base;
+}
+
+struct shm_ring *map_ring (int fd, const char *name, size_t size)
+{
+	struct shm_ring *ring = malloc(sizeof(struct shm_ring));
+
+	if (!ring)
+		return NULL;
+
+	ring->header = mmap(NULL, SHM_HEADER_SIZE, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED, fd, 0);
+	ring->data = NULL;
+	ring->size = size;
+	ring->name = strdup(name);
+
+	if (ring->header == MAP_FAILED)
+		ring->header = NULL;
+	if (ring->header && !size)
+		ring->size = size = ring->header->size;
+	if (ring->header && size)
+		ring->data = map_mirror(fd, size);
+
+	if (!ring->header || !ring->data || !ring->name) {
+		if (ring->header)
+			munmap(ring->header, SHM_HEADER_SIZE);
+		free(ring->name);
+		free(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+void unmap_ring (struct shm_ring **ring_p)
+{
+	struct shm_ring *ring = *ring_p;
+	if (!ring) return;
+
+	munmap(ring->data, 2 * ring->size);
+	munmap(ring->header, SHM_HEADER_SIZE);
+	free(ring->name);
+	free(ring);
+	*ring_p = NULL;
+}
+
+// Editor side. size is rounded up to a power of two of at least a page.
+struct shm_ring *shm_ring_create (const char *name, size_t size)
+{
+	struct shm_ring *ring;
+	size_t pow = sysconf(_SC_PAGESIZE);
+	int fd;
+
+	while (pow < size)
+		pow *= 2;
+
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, SHM_HEADER_SIZE + pow)) {
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	ring = map_ring(fd, name, pow);
+	close(fd);
+
+	if (!ring) {
+		shm_unlink(name);
+		return NULL;
+	}
+
+	ring->header->size = pow;
+	atomic_init(&ring->header->owner, 0);
+	atomic_init(&ring->header->head, 0);
+	atomic_init(&ring->header->tail, 0);
+	atomic_init(&ring->header->producer_waiting, 0);
+	atomic_init(&ring->header->consumer_waiting, 0);
+	atomic_init(&ring->header->wake, 0);
+	ring->header->magic = SHM_RING_MAGIC;
+
+	return ring;
+}
+
+void shm_ring_destroy (struct shm_ring **ring_p)
+{
+	if (!*ring_p) return;
+
+	shm_unlink((*ring_p)->name);
+	unmap_ring(ring_p);
+}
+
+// Producer side. Fails if another live process has the ring open.
+struct shm_ring *shm_ring_open (const char *name)
+{
+	struct shm_ring *ring;
+	int fd = shm_open(name, O_RDWR, 0);
+	int owner;
+
+	if (fd < 0)
+		return NULL;
+
+	ring = map_ring(fd, name, 0);
+	close(fd);
+
+	if (!ring)
+		return NULL;
+
+	if (ring->header->magic != SHM_RING_MAGIC) {
+		unmap_ring(&ring);
+		return NULL;
+	}
+
+	owner = atomic_load(&ring->header->owner);
+	if ((owner && (kill(owner, 0) == 0 || errno == EPERM)) ||
+	    !atomic_compare_exchange_strong(&ring->header->owner, &owner, getpid())) {
+		unmap_ring(&ring);
+		errno = EBUSY;
+		return NULL;
+	}
+
+	return ring;
+}
+
+// Wait for len contiguous bytes of space and return where to write them.
+// len must not exceed the ring size.
+void *shm_ring_reserve (struct shm_ring *ring, size_t len)
+{
+	struct shm_header *header = ring->header;
+	unsigned tail = atomic_load_explicit(&header->tail, memory_order_relaxed);
+	unsigned head;
+
+	while (ring->size - (tail - (head = atomic_load(&header->head))) < len) {
+		atomic_store(&header->producer_waiting, 1);
+		if (ring->size - (tail - atomic_load(&header->head)) < len)
+			shm_futex_wait(&header->head, head);
+	}
+
+	return ring->data + (tail & (ring->size - 1));
+}
+
+// Publish len reserved bytes, waking the editor if it went idle.
+void shm_ring_commit (struct shm_ring *ring, size_t len)
+{
+	struct shm_header *header = ring->header;
+
+	atomic_fetch_add(&header->tail, len);
+
+	if (atomic_exchange(&header->consumer_waiting, 0)) {
+		atomic_fetch_add(&header->wake, 1);
+		shm_futex_wake(&header->wake);
+	}
+}
+
+void shm_ring_write (struct shm_ring *ring, const void *src, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = len < ring->size / 2 ? len : ring->size / 2;
+		memcpy(shm_ring_reserve(ring, n), src, n);
+		shm_ring_commit(ring, n);
+		src = (const unsigned char *) src + n;
+		len -= n;
+	}
+}
+
+void shm_ring_close (struct shm_ring **ring_p)
+{
+	if (!*ring_p) return;
+
+	atomic_store(&(*ring_p)->header->owner, 0);
+	unmap_ring(ring_p);
+}